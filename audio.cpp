@@ -11,6 +11,15 @@
 
 #define MAX_AUDIO_POINTERS 5
 
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <assert.h>
+#include <string.h>
+
+#include "queues.cpp"
+#include "realtime.cpp"
+
 // a sample 1m away = xxx milliseconds delay
 #define METERS_TO_DELAY_MS 250
 
@@ -25,10 +34,38 @@ struct audio_pointer
   uint sound_index;
 };
 
-uint audio_pointers_count = 0;
-audio_pointer audio_pointers[MAX_AUDIO_POINTERS];
+// a complete set of pointers to play from the start. The sampling thread never
+// changes a scene once it has been queued, and the audio thread only switches to a
+// new one between buffers, so it never mixes half of one scene with half of another
+struct audio_scene
+{
+  uint pointer_count;
+  audio_pointer pointers[MAX_AUDIO_POINTERS];
+  // when it was queued, to measure how long it took to start playing
+  std::chrono::steady_clock::time_point queued;
+};
+
+// scenes waiting for the audio thread. This only needs to cover the scenes queued
+// while one buffer is mixed
+#define AUDIO_SCENE_QUEUE_LENGTH 8
+spsc_ring<audio_scene, AUDIO_SCENE_QUEUE_LENGTH> scene_queue;
+
+// how long scenes took from being queued to their first sample being handed to
+// ALSA, in ms. Only written by the audio thread
+struct audio_latency_stats
+{
+  std::atomic<float> last_ms;
+  std::atomic<float> max_ms;
+  std::atomic<double> total_ms;
+  std::atomic<unsigned long> scenes;
+  // scenes which didn't fit in the queue, or were replaced before they started
+  std::atomic<unsigned long> dropped;
+};
+audio_latency_stats scene_latency;
 
 std::thread audio_thread;
+// cleared by stop_audio to get the audio thread to finish
+std::atomic<bool> audio_running(false);
 
 // array of arrays array containing our audio samples
 #define SOUND_COUNT 5
@@ -47,7 +84,19 @@ int16_t *alsa_buffer;
 int alsa_buffer_length;
 snd_pcm_uframes_t alsa_frames_length;
 
-bool sound_ready;
+// queues a scene to replace whatever is playing. The queue only has room for one
+// producer, so this is only called from the sampling thread (and from the main
+// thread before the sampling thread starts)
+void play_scene(const audio_pointer *pointers, uint pointer_count)
+{
+  assert(pointer_count <= MAX_AUDIO_POINTERS);
+
+  audio_scene scene;
+  scene.pointer_count = pointer_count;
+  memcpy(scene.pointers, pointers, pointer_count * sizeof(audio_pointer));
+  scene.queued = std::chrono::steady_clock::now();
+  if (!scene_queue.push(scene)) scene_latency.dropped++;
+}
 
 void read_audio_file(char const *path, uint sound_index)
 {
@@ -74,14 +123,14 @@ void read_audio_file(char const *path, uint sound_index)
   printw("%i milliseconds in length\n", sound_array_length[sound_index] * 1000 / AUDIO_SAMPLE_BYTE_SIZE / AUDIO_SAMPLE_RATE);
 }
 
-uint get_maximum_delayms()
+uint get_maximum_delayms(const audio_scene &scene)
 {
   uint maxdelayms = 0;
 
-  for (int i = 0; i < audio_pointers_count; i++)
+  for (int i = 0; i < scene.pointer_count; i++)
   {
-    if (audio_pointers[i].delayms > maxdelayms)
-      maxdelayms = audio_pointers[i].delayms;
+    if (scene.pointers[i].delayms > maxdelayms)
+      maxdelayms = scene.pointers[i].delayms;
   }
 
   return maxdelayms;
@@ -94,9 +143,9 @@ uint get_delay_in_samples(uint delayms)
   return delay;
 }
 
-uint get_maximum_delay_samples()
+uint get_maximum_delay_samples(const audio_scene &scene)
 {
-  return get_delay_in_samples(get_maximum_delayms());
+  return get_delay_in_samples(get_maximum_delayms(scene));
 }
 
 // gets a single byte sample. The samplei is the current sample index, delayms
@@ -119,10 +168,16 @@ void audio_loop()
   int samplei = -1;
   snd_pcm_uframes_t frames_to_deliver;
   uint samples_to_deliver;
-  sound_ready = false;
+  // the scene being played, which is only replaced between buffers
+  audio_scene scene;
+  scene.pointer_count = 0;
+  // set when the scene starts in the buffer being mixed
+  bool scene_starting = false;
 
   assert(alsa_buffer_length % 4 == 0);
 
+  if (use_memory_locking) prefault_stack();
+
   if ((pcm = snd_pcm_prepare(pcm_handle)) < 0)
   {
     printw("cannot prepare audio interface for use (%s)\n", snd_strerror(pcm));
@@ -130,11 +185,20 @@ void audio_loop()
     exit(1);
   }
 
-  while (1)
+  while (audio_running)
   {
-    if (sound_ready)
+    // skip to the newest scene that has been queued
+    audio_scene queued_scene;
+    bool has_new_scene = false;
+    while (scene_queue.pop(queued_scene))
     {
-      sound_ready = false;
+      if (has_new_scene) scene_latency.dropped++;
+      has_new_scene = true;
+    }
+    if (has_new_scene)
+    {
+      scene = queued_scene;
+      scene_starting = true;
 
       samplei = 0;
     }
@@ -212,20 +276,20 @@ void audio_loop()
       int16_t sample16_left = 0;
       int16_t sample16_right = 0;
 
-      if (samplei + 1 >= sound_array_length[1] + get_maximum_delay_samples())
+      if (samplei + 1 >= sound_array_length[1] + get_maximum_delay_samples(scene))
       {
         samplei = -1;
       }
 
       if (samplei >= 0)
       {
-        for (int pointeri = 0; pointeri < audio_pointers_count; pointeri++)
+        for (int pointeri = 0; pointeri < scene.pointer_count; pointeri++)
         {
-          auto sample_delayms = audio_pointers[pointeri].delayms;
-          auto sound_index = audio_pointers[pointeri].sound_index;
+          auto sample_delayms = scene.pointers[pointeri].delayms;
+          auto sound_index = scene.pointers[pointeri].sound_index;
 
           int16_t this_sample16_left = get_sample(samplei, sample_delayms, sound_index);
-          sample16_left += this_sample16_left * audio_pointers[pointeri].left_amount;
+          sample16_left += this_sample16_left * scene.pointers[pointeri].left_amount;
 
           if (sample16_left > 65535)
           {
@@ -235,7 +299,7 @@ void audio_loop()
           }
 
           int16_t this_sample16_right = get_sample(samplei, sample_delayms, sound_index);
-          sample16_right += this_sample16_right * audio_pointers[pointeri].right_amount;
+          sample16_right += this_sample16_right * scene.pointers[pointeri].right_amount;
           if (sample16_right > 65535)
             sample16_right = 65535;
         }
@@ -265,6 +329,17 @@ void audio_loop()
         printw("ERROR. Can't write to PCM device. %s\n", snd_strerror(pcm));
         refresh();
       }
+
+      if (scene_starting)
+      {
+        scene_starting = false;
+        auto latency = std::chrono::steady_clock::now() - scene.queued;
+        float latency_ms = std::chrono::duration_cast<std::chrono::microseconds>(latency).count() / 1e3;
+        scene_latency.last_ms = latency_ms;
+        scene_latency.max_ms = std::max(scene_latency.max_ms.load(), latency_ms);
+        scene_latency.total_ms = scene_latency.total_ms + latency_ms;
+        scene_latency.scenes++;
+      }
     }
   }
 }
@@ -328,12 +403,23 @@ int setup_audio(const char *device_name)
   alsa_buffer_length = alsa_frames_length * channels; /* 2 -> sample size */
 
   alsa_buffer = (int16_t *)malloc(alsa_buffer_length * sizeof(int16_t));
+  // touched now so the audio thread doesn't fault it in on its first period
+  memset(alsa_buffer, 0, alsa_buffer_length * sizeof(int16_t));
   printw("Buffer size: %lu\n", alsa_buffer_length);
 
   printw("Starting audio thread \n");
   refresh();
 
+  audio_running = true;
   audio_thread = std::thread(&audio_loop);
+  thread_setup.configure(audio_thread, THREAD_AUDIO);
 
   return 0;
+}
+
+// waits for the audio thread to finish the buffer it's on
+void stop_audio()
+{
+  audio_running = false;
+  if (audio_thread.joinable()) audio_thread.join();
 }
\ No newline at end of file
@@ -0,0 +1,446 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <functional>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <stdio.h>
+#include <string.h>
+
+// An offline check of the depth filters, run with --replay <recording> --benchmark.
+// Every frame of the recording goes through our filters and through the plain
+// implementations they replaced. Any frame where the two disagree is counted, and
+// the time each took is printed at the end. This doesn't touch the camera, the
+// audio or ncurses, so it can run on a build machine.
+
+bool benchmark_mode = false;
+
+// the total time spent in one implementation of a stage
+struct benchmark_timing
+{
+  const char *name;
+  double total_ms;
+  long runs;
+
+  benchmark_timing(const char *name) : name(name), total_ms(0), runs(0) {}
+
+  void time(const std::function<void()> &stage)
+  {
+    auto start = std::chrono::high_resolution_clock::now();
+    stage();
+    auto duration = std::chrono::high_resolution_clock::now() - start;
+    total_ms += std::chrono::duration_cast<std::chrono::microseconds>(duration).count() / 1e3;
+    runs++;
+  }
+
+  void print()
+  {
+    printf("  %-32s %8.3fms per frame\n", name, runs > 0 ? total_ms / runs : 0);
+  }
+};
+
+// a fast implementation that has to give exactly the same result as a reference one
+struct benchmark_check
+{
+  const char *name;
+  long frames;
+  long mismatched_frames;
+
+  benchmark_check(const char *name) : name(name), frames(0), mismatched_frames(0) {}
+
+  void compare(bool equal)
+  {
+    frames++;
+    if (!equal) mismatched_frames++;
+  }
+
+  void print()
+  {
+    printf("  %-32s %ld of %ld frames differ\n", name, mismatched_frames, frames);
+  }
+};
+
+bool matrices_equal(const cv::Mat &a, const cv::Mat &b)
+{
+  if (a.rows != b.rows || a.cols != b.cols || a.type() != b.type()) return false;
+
+  size_t row_bytes = a.cols * a.elemSize();
+  for (int row = 0; row < a.rows; row++) {
+    if (memcmp(a.ptr(row), b.ptr(row), row_bytes) != 0) return false;
+  }
+  return true;
+}
+
+// hole_filling_filter as it was before it was vectorised
+void hole_filling_filter_reference(cv::Mat mat) {
+  for(int row = 0; row<mat.rows; row++) {
+    uint16_t *distances = mat.ptr<uint16_t>(row);
+    for (int col = 1; col<mat.cols; col++) {
+      if (distances[col] == 0) {
+        distances[col] = distances[col-1];
+      }
+    }
+  }
+}
+
+// whether two label images split the frame up in the same way, even if the
+// components are numbered differently
+bool same_partition(const cv::Mat &a, const cv::Mat &b)
+{
+  if (a.rows != b.rows || a.cols != b.cols) return false;
+
+  // the label each label maps to in the other image, or -1 if it hasn't been seen
+  std::vector<int32_t> a_to_b, b_to_a;
+  for (int row = 0; row < a.rows; row++) {
+    const int32_t *a_labels = a.ptr<int32_t>(row);
+    const int32_t *b_labels = b.ptr<int32_t>(row);
+
+    for (int col = 0; col < a.cols; col++) {
+      int32_t a_label = a_labels[col];
+      int32_t b_label = b_labels[col];
+      if ((a_label == 0) != (b_label == 0)) return false;
+
+      if (a_label >= (int32_t)a_to_b.size()) a_to_b.resize(a_label + 1, -1);
+      if (b_label >= (int32_t)b_to_a.size()) b_to_a.resize(b_label + 1, -1);
+      if (a_to_b[a_label] == -1) a_to_b[a_label] = b_label;
+      if (b_to_a[b_label] == -1) b_to_a[b_label] = a_label;
+      if (a_to_b[a_label] != b_label || b_to_a[b_label] != a_label) return false;
+    }
+  }
+  return true;
+}
+
+// the mask of the regions enclosed by edges, built as sample() did before the
+// separate passes were fused into build_edge_mask
+void build_edge_mask_reference(const cv::Mat &distances, cv::Mat &mask)
+{
+  distances.convertTo(mask, CV_8U, 0.001);
+  cv::min(mask, MAX_DEPTH_THRESHOLD, mask);
+  cv::Laplacian(mask, mask, CV_8U, 3, 1, 0, cv::BORDER_DEFAULT);
+  cv::dilate(mask, mask, cv::getStructuringElement(cv::MORPH_ELLIPSE, cv::Size(3,3)));
+
+  for (int row = 0; row < mask.rows; row++) {
+    uint8_t *edge = mask.ptr<uint8_t>(row);
+    for (int col = 0; col < mask.cols; col++) {
+      edge[col] = edge[col] == 0;
+    }
+  }
+}
+
+// the mask build_edge_mask gives with EDGE_LAPLACIAN or EDGE_SOBEL, worked out a
+// pixel at a time from the kernels as written. Rows and columns reflect at the
+// borders as with BORDER_REFLECT_101, and the edges are dilated by a 3x3 cross
+void build_millimetre_edge_mask_reference(const cv::Mat &distances, cv::Mat &mask, int max_meters, edge_mode mode)
+{
+  int rows = distances.rows;
+  int cols = distances.cols;
+  auto reflect = [](int i, int size) {
+    if (size == 1) return 0;
+    if (i < 0) return -i;
+    if (i >= size) return 2 * size - 2 - i;
+    return i;
+  };
+  auto depth = [&](int row, int col) {
+    return std::min((int)distances.at<uint16_t>(reflect(row, rows), reflect(col, cols)), max_meters * 1000);
+  };
+
+  cv::Mat edges(rows, cols, CV_8UC1);
+  for (int row = 0; row < rows; row++) {
+    for (int col = 0; col < cols; col++) {
+      bool edge;
+      if (mode == EDGE_LAPLACIAN) {
+        int laplacian = 2 * (depth(row - 1, col - 1) + depth(row - 1, col + 1) + depth(row + 1, col - 1)
+          + depth(row + 1, col + 1)) - 8 * depth(row, col);
+        edge = laplacian > 2 * LAPLACIAN_EDGE_MM;
+      } else {
+        int x = (depth(row - 1, col + 1) + 2 * depth(row, col + 1) + depth(row + 1, col + 1))
+          - (depth(row - 1, col - 1) + 2 * depth(row, col - 1) + depth(row + 1, col - 1));
+        int y = (depth(row + 1, col - 1) + 2 * depth(row + 1, col) + depth(row + 1, col + 1))
+          - (depth(row - 1, col - 1) + 2 * depth(row - 1, col) + depth(row - 1, col + 1));
+        edge = abs(x) + abs(y) > SOBEL_EDGE_MM;
+      }
+      edges.at<uint8_t>(row, col) = edge;
+    }
+  }
+
+  mask.create(rows, cols, CV_8UC1);
+  for (int row = 0; row < rows; row++) {
+    for (int col = 0; col < cols; col++) {
+      bool edge = edges.at<uint8_t>(row, col)
+        || (row > 0 && edges.at<uint8_t>(row - 1, col)) || (row + 1 < rows && edges.at<uint8_t>(row + 1, col))
+        || (col > 0 && edges.at<uint8_t>(row, col - 1)) || (col + 1 < cols && edges.at<uint8_t>(row, col + 1));
+      mask.at<uint8_t>(row, col) = !edge;
+    }
+  }
+}
+
+// the polar histogram's bins, worked out a pixel at a time. The bins are split up
+// the same way as in histogram, which has to have been built from band already
+std::vector<uint16_t> polar_histogram_reference(const cv::Mat &band, const polar_histogram &histogram, int percentile)
+{
+  std::vector<std::vector<uint16_t> > bin_depths(histogram.bins.size());
+  for (int col = 0; col < band.cols; col++) {
+    uint16_t nearest = 0;
+    for (int row = 0; row < band.rows; row++) {
+      uint16_t depth = band.at<uint16_t>(row, col);
+      if (depth != 0 && (nearest == 0 || depth < nearest)) nearest = depth;
+    }
+    if (nearest != 0) bin_depths[histogram.get_bin(col)].push_back(nearest);
+  }
+
+  std::vector<uint16_t> bins(histogram.bins.size(), 0);
+  for (size_t bin = 0; bin < bins.size(); bin++) {
+    std::vector<uint16_t> &depths = bin_depths[bin];
+    if (depths.empty()) continue;
+    std::sort(depths.begin(), depths.end());
+    bins[bin] = depths[(depths.size() - 1) * percentile / 100];
+  }
+  return bins;
+}
+
+// how many pixels in rect the occupancy map should count as nearer than limit_mm,
+// counted a pixel at a time
+int count_nearer_reference(const cv::Mat &distances, const cv::Mat &ignore, cv::Rect rect, uint16_t limit_mm)
+{
+  int count = 0;
+  for (int row = rect.y; row < rect.y + rect.height; row++) {
+    for (int col = rect.x; col < rect.x + rect.width; col++) {
+      uint16_t depth = distances.at<uint16_t>(row, col);
+      if (depth != 0 && depth < limit_mm && ignore.at<uint8_t>(row, col) == 0) count++;
+    }
+  }
+  return count;
+}
+
+// a copy of mask with a few tiles of the segmenter changed: a line of edges across
+// the first tile, and a patch cleared of edges over the corner where four tiles meet
+void change_segment_tiles(const cv::Mat &mask, cv::Mat &changed)
+{
+  mask.copyTo(changed);
+  cv::Rect frame(0, 0, mask.cols, mask.rows);
+  changed(cv::Rect(0, SEGMENT_TILE_SIZE / 2, SEGMENT_TILE_SIZE, 1) & frame).setTo(0);
+  changed(cv::Rect(SEGMENT_TILE_SIZE - 4, SEGMENT_TILE_SIZE - 4, 8, 8) & frame).setTo(1);
+}
+
+// a frame our recordings are unlikely to hold much of: every row mixes long runs of
+// holes with jumps between the nearest and the furthest depths, whose differences
+// need the longest varints, and short runs of small steps in between
+void build_codec_test_frame(cv::Size size, cv::Mat &depth)
+{
+  std::minstd_rand random(1);
+  depth.create(size, CV_16UC1);
+
+  for (int row = 0; row < depth.rows; row++) {
+    uint16_t *out = depth.ptr<uint16_t>(row);
+    int col = 0;
+    while (col < depth.cols) {
+      int kind = random() % 3;
+      int length = kind == 0 ? 1 + random() % 256 : 1 + random() % 32;
+      uint16_t value = 1 + random() % 65535;
+      for (; length > 0 && col < depth.cols; length--, col++) {
+        if (kind == 0) {
+          out[col] = 0;
+        } else if (kind == 1) {
+          out[col] = (col % 2 == 0) ? 1 : 65535;
+        } else {
+          value = std::min(std::max(value + (int)(random() % 9) - 4, 1), 65535);
+          out[col] = value;
+        }
+      }
+    }
+  }
+}
+
+// encodes depth and decodes it again, which has to give back exactly the same frame
+bool codec_round_trips(const cv::Mat &depth, std::vector<uint8_t> &encoded, cv::Mat &decoded,
+  benchmark_timing &encode_time, benchmark_timing &decode_time)
+{
+  encoded.resize(depth_codec_max_encoded_size(depth.cols, depth.rows));
+  size_t bytes = 0;
+  encode_time.time([&]() { bytes = encode_depth_delta_rle(depth, encoded.data()); });
+
+  decoded.create(depth.rows, depth.cols, CV_16UC1);
+  bool decoded_ok = false;
+  decode_time.time([&]() { decoded_ok = decode_depth_delta_rle(encoded.data(), bytes, decoded); });
+  return decoded_ok && matrices_equal(depth, decoded);
+}
+
+// runs every frame of the source through the checks, returning EXIT_FAILURE if
+// any of them differed
+int benchmark_filters(frame_source *source)
+{
+  benchmark_timing hole_fill_reference_time("hole filling (reference)");
+  benchmark_timing hole_fill_time("hole filling");
+  benchmark_check hole_fill_check("hole filling");
+  benchmark_timing median_reference_time("median (cv::medianBlur)");
+  benchmark_timing median_time("median");
+  benchmark_check median_check("median");
+  benchmark_timing edge_mask_reference_time("edge mask (OpenCV)");
+  benchmark_timing edge_mask_time("edge mask");
+  benchmark_check edge_mask_check("edge mask");
+  benchmark_timing laplacian_mm_time("edge mask (laplacian, mm)");
+  benchmark_check laplacian_mm_check("edge mask (laplacian, mm)");
+  benchmark_timing sobel_mm_time("edge mask (sobel, mm)");
+  benchmark_check sobel_mm_check("edge mask (sobel, mm)");
+  benchmark_timing labelling_reference_time("labelling (connectedComponents)");
+  benchmark_timing labelling_time("labelling and means");
+  benchmark_check labelling_check("labelling");
+  benchmark_timing incremental_time("labelling (incremental)");
+  benchmark_check incremental_check("incremental labelling");
+  benchmark_check changed_tiles_check("incremental labelling (changed)");
+  benchmark_timing floor_time("floor removal");
+  benchmark_timing occupancy_time("occupancy map");
+  benchmark_check occupancy_check("occupancy map");
+  benchmark_timing polar_time("polar histogram");
+  benchmark_check polar_check("polar histogram");
+  benchmark_timing encode_time("depth codec (encode)");
+  benchmark_timing decode_time("depth codec (decode)");
+  benchmark_check codec_check("depth codec");
+
+  cv::Mat decimated, expected, actual;
+  cv::Mat filtered, expected_edge_mask, edge_mask, expected_labels, incremental_filtered;
+  cv::Mat millimetre_edge_mask;
+  cv::Mat changed_edge_mask, unlabelled, changed_expected, changed_actual;
+  depth_segmenter segmenter, incremental_segmenter;
+  ground_plane ground;
+  cv::Mat floor_mask;
+  polar_histogram polar;
+  occupancy_map occupancy;
+  std::minstd_rand random(1);
+  std::vector<uint8_t> encoded;
+  cv::Mat decoded;
+
+  source->start();
+  rs2_intrinsics intrinsics = source->get_intrinsics();
+  rays.build(intrinsics, get_decimation_amount(intrinsics.width), source->get_serial());
+
+  // the frames are recorded as they come from the camera, so the codec is checked
+  // on those, along with a frame made to be hard to encode
+  cv::Mat codec_test_frame;
+  build_codec_test_frame(cv::Size(intrinsics.width, intrinsics.height), codec_test_frame);
+  benchmark_timing unused_time("");
+  codec_check.compare(codec_round_trips(codec_test_frame, encoded, decoded, unused_time, unused_time));
+
+  depth_frame_data frame;
+  while (source->wait_for_frame(frame)) {
+    codec_check.compare(codec_round_trips(frame.depth, encoded, decoded, encode_time, decode_time));
+
+    // get the frame to the point sample() starts filtering it
+    cv::Mat depth = frame.depth;
+    int decimation_amount = get_decimation_amount(depth.cols);
+    if (decimation_amount > 1) {
+      decimate_depth(frame.depth, decimated, decimation_amount);
+      depth = decimated;
+    }
+    cv::Mat millimetres = convert_to_millimetres(depth, frame.depth_scale);
+
+    // before the median filter, so there are plenty of holes to fill
+    millimetres.copyTo(expected);
+    millimetres.copyTo(actual);
+    hole_fill_reference_time.time([&]() { hole_filling_filter_reference(expected); });
+    hole_fill_time.time([&]() { hole_filling_filter(actual); });
+    hole_fill_check.compare(matrices_equal(expected, actual));
+
+    median_reference_time.time([&]() { cv::medianBlur(millimetres, expected, 5); });
+    median_time.time([&]() { median_filter_5x5(millimetres, actual); });
+    median_check.compare(matrices_equal(expected, actual));
+
+    // the labels are compared on the frame as sample() would have it by then
+    median_filter_5x5(millimetres, filtered);
+    hole_filling_filter(filtered);
+    // the floor is found at random, so it's only timed
+    floor_time.time([&]() {
+      ground.estimate(filtered, cv::Point(0, 0), frame.gravity);
+      ground.mask_floor(filtered, cv::Point(0, 0), floor_mask);
+    });
+    cv::Mat band = filtered(get_polar_band(filtered.size()));
+    polar_time.time([&]() { polar.build(band, polar_bin_count, polar_percentile); });
+    polar_check.compare(polar.bins == polar_histogram_reference(band, polar, polar_percentile));
+    edge_mask_reference_time.time([&]() { build_edge_mask_reference(filtered, expected_edge_mask); });
+    edge_mask_time.time([&]() { build_edge_mask(filtered, edge_mask, MAX_DEPTH_THRESHOLD); });
+    edge_mask_check.compare(matrices_equal(expected_edge_mask, edge_mask));
+    // the millimetre edges have no OpenCV equivalent, so they're checked against
+    // the kernels worked out a pixel at a time
+    laplacian_mm_time.time([&]() { build_edge_mask(filtered, millimetre_edge_mask, MAX_DEPTH_THRESHOLD, EDGE_LAPLACIAN); });
+    build_millimetre_edge_mask_reference(filtered, expected_edge_mask, MAX_DEPTH_THRESHOLD, EDGE_LAPLACIAN);
+    laplacian_mm_check.compare(matrices_equal(expected_edge_mask, millimetre_edge_mask));
+    sobel_mm_time.time([&]() { build_edge_mask(filtered, millimetre_edge_mask, MAX_DEPTH_THRESHOLD, EDGE_SOBEL); });
+    build_millimetre_edge_mask_reference(filtered, expected_edge_mask, MAX_DEPTH_THRESHOLD, EDGE_SOBEL);
+    sobel_mm_check.compare(matrices_equal(expected_edge_mask, millimetre_edge_mask));
+    filtered.copyTo(incremental_filtered);
+    filtered.copyTo(unlabelled);
+    labelling_reference_time.time([&]() { cv::connectedComponents(edge_mask, expected_labels); });
+    labelling_time.time([&]() { segmenter.segment(edge_mask, filtered); });
+    labelling_check.compare(same_partition(expected_labels, segmenter.labels));
+
+    // the occupancy map is built from the means, as in sample(), and read over
+    // rectangles anywhere in the frame, to cover the vector and scalar columns
+    occupancy_time.time([&]() { occupancy.build(filtered, NEAR_THRESHOLD_MM, MID_THRESHOLD_MM, floor_mask); });
+    bool counts_equal = true;
+    for (int i = 0; i < 64; i++) {
+      int x = random() % (filtered.cols + 1);
+      int y = random() % (filtered.rows + 1);
+      cv::Rect rect(x, y, random() % (filtered.cols - x + 1), random() % (filtered.rows - y + 1));
+      counts_equal = counts_equal
+        && occupancy.count_near(rect) == count_nearer_reference(filtered, floor_mask, rect, NEAR_THRESHOLD_MM)
+        && occupancy.count_mid(rect) == count_nearer_reference(filtered, floor_mask, rect, MID_THRESHOLD_MM);
+    }
+    occupancy_check.compare(counts_equal);
+
+    // reusing the labels from the frame before has to give exactly the same result
+    incremental_time.time([&]() { incremental_segmenter.segment(edge_mask, incremental_filtered, true); });
+    incremental_check.compare(matrices_equal(segmenter.labels, incremental_segmenter.labels)
+      && matrices_equal(filtered, incremental_filtered));
+
+    // consecutive frames of a still scene can have the same mask, when every tile
+    // is reused, so a few tiles are also changed, which only they are labelled again for
+    change_segment_tiles(edge_mask, changed_edge_mask);
+    unlabelled.copyTo(changed_expected);
+    unlabelled.copyTo(changed_actual);
+    segmenter.segment(changed_edge_mask, changed_expected);
+    incremental_segmenter.segment(changed_edge_mask, changed_actual, true);
+    changed_tiles_check.compare(matrices_equal(segmenter.labels, incremental_segmenter.labels)
+      && matrices_equal(changed_expected, changed_actual));
+  }
+
+  source->stop();
+
+  printf("Benchmarked %ld frames\n", hole_fill_check.frames);
+  hole_fill_reference_time.print();
+  hole_fill_time.print();
+  median_reference_time.print();
+  median_time.print();
+  edge_mask_reference_time.print();
+  edge_mask_time.print();
+  laplacian_mm_time.print();
+  sobel_mm_time.print();
+  labelling_reference_time.print();
+  labelling_time.print();
+  incremental_time.print();
+  floor_time.print();
+  occupancy_time.print();
+  polar_time.print();
+  encode_time.print();
+  decode_time.print();
+  printf("Checks:\n");
+  hole_fill_check.print();
+  median_check.print();
+  edge_mask_check.print();
+  laplacian_mm_check.print();
+  sobel_mm_check.print();
+  labelling_check.print();
+  incremental_check.print();
+  changed_tiles_check.print();
+  occupancy_check.print();
+  polar_check.print();
+  codec_check.print();
+
+  bool all_equal = hole_fill_check.mismatched_frames == 0 && median_check.mismatched_frames == 0
+    && edge_mask_check.mismatched_frames == 0 && laplacian_mm_check.mismatched_frames == 0
+    && sobel_mm_check.mismatched_frames == 0 && labelling_check.mismatched_frames == 0
+    && incremental_check.mismatched_frames == 0 && changed_tiles_check.mismatched_frames == 0
+    && occupancy_check.mismatched_frames == 0 && polar_check.mismatched_frames == 0
+    && codec_check.mismatched_frames == 0;
+  return all_equal ? EXIT_SUCCESS : EXIT_FAILURE;
+}
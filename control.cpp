@@ -0,0 +1,225 @@
+#pragma once
+
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <stdarg.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdexcept>
+
+// How the input loop tells the sampling thread what to do. The input loop posts
+// clicks and power presses as they arrive, and the sampling thread blocks until
+// there's something for it to do, rather than waking up every few milliseconds to
+// check some flags. So an idle device sleeps, and a click wakes the sampler
+// straight away. How long each click took to get to the sampler is kept, to
+// compare against the old polling.
+
+enum sampler_state
+{
+  SAMPLER_IDLE,      // the camera is running, and we're waiting for a click
+  SAMPLER_DETECTING, // watching for obstacles for a while after a click
+  SAMPLER_LOW_POWER, // the camera is stopped until the next click
+  SAMPLER_WAKING     // restarting the camera after that click
+};
+
+class sampler_control
+{
+  typedef std::chrono::steady_clock control_clock;
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  bool click_pending = false;
+  // whether the pending click came from the input loop, and so counts towards the
+  // wake times
+  bool click_timed = false;
+  bool low_power_requested = false;
+  bool quit_requested = false;
+  control_clock::time_point click_time;
+
+public:
+  // how long clicks took to reach the sampling thread, in ms
+  float last_wake_ms = 0;
+  float total_wake_ms = 0;
+  float max_wake_ms = 0;
+  unsigned long wakes = 0;
+
+  // called by the input loop. A click also cancels low power mode
+  void click()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      click_pending = true;
+      click_timed = true;
+      low_power_requested = false;
+      click_time = control_clock::now();
+    }
+    changed.notify_one();
+  }
+
+  void request_low_power()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      low_power_requested = true;
+    }
+    changed.notify_one();
+  }
+
+  // takes the click that's waiting, if there is one, without blocking
+  bool take_click()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!click_pending) return false;
+    click_pending = false;
+    if (!click_timed) return true;
+
+    auto latency = control_clock::now() - click_time;
+    last_wake_ms = std::chrono::duration_cast<std::chrono::microseconds>(latency).count() / 1e3;
+    total_wake_ms += last_wake_ms;
+    max_wake_ms = std::max(max_wake_ms, last_wake_ms);
+    wakes++;
+    return true;
+  }
+
+  // called by the sampling thread to take a click again, when the frame it was
+  // taking for it was thrown away. Unlike a real click this leaves low power mode
+  // alone, and doesn't count towards the wake times
+  void put_back_click()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      click_pending = true;
+      click_timed = false;
+    }
+    changed.notify_one();
+  }
+
+  bool low_power()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return low_power_requested;
+  }
+
+  // called when the program is asked to exit, to get the sampling thread to finish
+  void request_quit()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      quit_requested = true;
+    }
+    changed.notify_one();
+  }
+
+  bool quitting()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return quit_requested;
+  }
+
+  // sleeps until there's a click, or a request for low power mode if we aren't in
+  // it, or until we're asked to quit
+  void wait(bool for_low_power)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [&] { return click_pending || quit_requested || (for_low_power && low_power_requested); });
+  }
+};
+
+sampler_control control;
+
+// What the other threads want on the screen. ncurses can only be used from one
+// thread, so they queue their output here instead, and the input loop prints it.
+// A byte down a pipe wakes the input loop, which sleeps on the pipe as well as
+// on the keyboard.
+class screen_log
+{
+  // a piece of text, or if clear_first is set a request to clear the screen
+  struct entry
+  {
+    bool clear_first;
+    std::string text;
+  };
+
+  std::mutex mutex;
+  std::vector<entry> entries;
+  int wake_pipe[2] = {-1, -1};
+
+  void add(const entry &new_entry)
+  {
+    bool was_empty;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      was_empty = entries.empty();
+      entries.push_back(new_entry);
+    }
+    // the input loop takes everything at once, so it only needs waking once
+    if (was_empty && wake_pipe[1] >= 0) {
+      char byte = 0;
+      if (write(wake_pipe[1], &byte, 1) < 0) {
+        // the pipe is full, so the input loop is already due to wake
+      }
+    }
+  }
+
+public:
+  // called by the input loop before any other thread is started
+  void open()
+  {
+    if (pipe(wake_pipe) != 0) throw std::runtime_error("Couldn't create the screen log's pipe");
+    fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+  }
+
+  // the file descriptor the input loop polls for output to print
+  int get_wake_fd()
+  {
+    return wake_pipe[0];
+  }
+
+  // takes a printf format, like printw
+  void post(const char *format, ...)
+  {
+    char text[512];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+
+    entry new_entry;
+    new_entry.clear_first = false;
+    new_entry.text = text;
+    add(new_entry);
+  }
+
+  void clear_screen()
+  {
+    entry new_entry;
+    new_entry.clear_first = true;
+    add(new_entry);
+  }
+
+  // prints everything that has been posted. Only call this from the input loop
+  void print_pending()
+  {
+    char bytes[64];
+    while (read(wake_pipe[0], bytes, sizeof(bytes)) > 0) {}
+
+    std::vector<entry> taken;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      taken.swap(entries);
+    }
+    for (const entry &printed : taken) {
+      if (printed.clear_first) clear();
+      if (!printed.text.empty()) printw("%s", printed.text.c_str());
+    }
+    if (!taken.empty()) refresh();
+  }
+};
+
+screen_log screen;
@@ -0,0 +1,231 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <atomic>
+#include <string.h>
+
+#include "simd-helpers.cpp"
+
+// A lossless codec for Z16 depth, used for the chunks of our recordings.
+//
+// Each row is split into runs of valid pixels and runs of zeros (the holes that
+// hole_filling_filter fills in later). The valid pixels are predicted from the
+// valid pixel before them on the same row, and only the difference is stored, so a
+// smooth wall costs one byte per pixel and a hole costs one or two bytes in total.
+//
+// An encoded frame is laid out as:
+//   uint32_t row_offsets[height]   where each row starts, from the start of the frame
+//   for each row:
+//     varint run lengths, alternating valid/zero and starting with valid (which may
+//       be 0), until they add up to the width
+//     varint zigzag differences, one per valid pixel
+//
+// The row offsets let rows be decoded in parallel, and the decoder reads plain
+// one-byte differences 8 at a time and undoes the prediction with a vector prefix sum.
+
+#define DEPTH_CODEC_DELTA_RLE 1
+
+// returns the most bytes encode_depth_delta_rle can write for a frame of this size
+size_t depth_codec_max_encoded_size(int width, int height)
+{
+  // per row: width + 1 runs of at most 3 bytes, and width differences of at most 3 bytes
+  return height * (sizeof(uint32_t) + 3 * (width + 1) + 3 * width);
+}
+
+inline uint8_t *write_varint(uint8_t *out, uint32_t value)
+{
+  while (value >= 0x80) {
+    *out++ = (value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+  *out++ = value;
+  return out;
+}
+
+// returns NULL if the value runs past end
+inline const uint8_t *read_varint(const uint8_t *in, const uint8_t *end, uint32_t &value)
+{
+  value = 0;
+  int shift = 0;
+  uint8_t byte;
+  do {
+    if (in >= end) return NULL;
+    byte = *in++;
+    value |= (uint32_t)(byte & 0x7F) << shift;
+    shift += 7;
+  } while ((byte & 0x80) && shift < 32);
+  return in;
+}
+
+// maps small positive and negative differences to small unsigned numbers (0, -1, 1, -2...)
+inline uint16_t zigzag_encode(uint16_t difference)
+{
+  return (uint16_t)(difference << 1) ^ (uint16_t)(-(difference >> 15));
+}
+
+inline uint16_t zigzag_decode(uint16_t value)
+{
+  return (value >> 1) ^ (uint16_t)(-(value & 1));
+}
+
+// encodes a CV_16UC1 frame, returning the number of bytes written to out
+size_t encode_depth_delta_rle(const cv::Mat &depth, uint8_t *out)
+{
+  assert(depth.type() == CV_16UC1);
+
+  uint32_t *row_offsets = (uint32_t *)out;
+  uint8_t *p = out + depth.rows * sizeof(uint32_t);
+
+  for (int row = 0; row < depth.rows; row++) {
+    const uint16_t *in = depth.ptr<uint16_t>(row);
+    row_offsets[row] = p - out;
+
+    // the runs
+    int col = 0;
+    while (col < depth.cols) {
+      int run_start = col;
+      while (col < depth.cols && in[col] != 0) col++;
+      p = write_varint(p, col - run_start);
+
+      if (col == depth.cols) break;
+
+      run_start = col;
+      while (col < depth.cols && in[col] == 0) col++;
+      p = write_varint(p, col - run_start);
+    }
+
+    // then the differences between the valid pixels
+    uint16_t previous = 0;
+    for (col = 0; col < depth.cols; col++) {
+      if (in[col] == 0) continue;
+      p = write_varint(p, zigzag_encode(in[col] - previous));
+      previous = in[col];
+    }
+  }
+
+  return p - out;
+}
+
+// undoes the prediction in place: values[i] += values[i-1] (modulo 2^16)
+void prefix_sum_u16(uint16_t *values, int count)
+{
+  int i = 0;
+  uint16_t carry = 0;
+
+#if THESIS_SIMD
+  u16x8 carry_v = u16x8_zero();
+  for (; i + U16X8_LANES <= count; i += U16X8_LANES) {
+    u16x8 v = u16x8_load(values + i);
+    v = u16x8_add(v, u16x8_shift_up<1>(v));
+    v = u16x8_add(v, u16x8_shift_up<2>(v));
+    v = u16x8_add(v, u16x8_shift_up<4>(v));
+    v = u16x8_add(v, carry_v);
+    carry_v = u16x8_broadcast_last(v);
+    u16x8_store(values + i, v);
+  }
+  if (i > 0) carry = values[i - 1];
+#endif
+
+  for (; i < count; i++) {
+    carry += values[i];
+    values[i] = carry;
+  }
+}
+
+// decodes count differences for one row into values. Returns NULL if the row runs out first
+const uint8_t *decode_differences(const uint8_t *in, const uint8_t *end, uint16_t *values, int count)
+{
+  int i = 0;
+
+  while (i < count) {
+#if THESIS_SIMD
+    // nearly every difference fits in a single byte, so check 8 bytes at a time
+    // for continuation bits and decode them all at once if there are none
+    uint64_t bytes;
+    if (i + U16X8_LANES <= count && in + sizeof(bytes) <= end) {
+      memcpy(&bytes, in, sizeof(bytes));
+      if ((bytes & 0x8080808080808080ULL) == 0) {
+        u16x8 v = u16x8_load_u8(in);
+        // zigzag decode
+        u16x8 sign = u16x8_sub(u16x8_zero(), u16x8_and(v, u16x8_set1(1)));
+        u16x8_store(values + i, u16x8_xor(u16x8_shr<1>(v), sign));
+        in += U16X8_LANES;
+        i += U16X8_LANES;
+        continue;
+      }
+    }
+#endif
+    uint32_t value;
+    in = read_varint(in, end, value);
+    if (in == NULL) return NULL;
+    values[i++] = zigzag_decode(value);
+  }
+
+  return in;
+}
+
+// decodes a frame written by encode_depth_delta_rle into depth, which must already
+// be a CV_16UC1 matrix of the right size. Returns false if the data is corrupt
+bool decode_depth_delta_rle(const uint8_t *data, size_t bytes, cv::Mat &depth)
+{
+  assert(depth.type() == CV_16UC1);
+
+  const uint32_t *row_offsets = (const uint32_t *)data;
+  if (bytes < depth.rows * sizeof(uint32_t)) return false;
+
+  std::atomic<bool> corrupt(false);
+
+  cv::parallel_for_(cv::Range(0, depth.rows), [&](const cv::Range &rows) {
+    // the decoded differences for one row, before they're spread over the runs
+    std::vector<uint16_t> values(depth.cols);
+    std::vector<uint16_t> runs(depth.cols + 1);
+
+    for (int row = rows.start; row < rows.end; row++) {
+      uint16_t *out = depth.ptr<uint16_t>(row);
+      const uint8_t *in = data + row_offsets[row];
+      const uint8_t *end = (row + 1 < depth.rows) ? data + row_offsets[row + 1] : data + bytes;
+      if (in > end || end > data + bytes) {
+        corrupt = true;
+        return;
+      }
+
+      int run_count = 0;
+      int covered = 0;
+      int valid_count = 0;
+      while (covered < depth.cols && in < end && run_count < (int)runs.size()) {
+        uint32_t run;
+        in = read_varint(in, end, run);
+        if (in == NULL || covered + run > (uint32_t)depth.cols) break;
+        runs[run_count] = run;
+        if (run_count % 2 == 0) valid_count += run;
+        covered += run;
+        run_count++;
+      }
+      if (covered != depth.cols) {
+        corrupt = true;
+        return;
+      }
+
+      if (decode_differences(in, end, &values[0], valid_count) == NULL) {
+        corrupt = true;
+        return;
+      }
+      prefix_sum_u16(&values[0], valid_count);
+
+      // spread the valid pixels back over the row, with the holes between them
+      const uint16_t *value = &values[0];
+      for (int i = 0; i < run_count; i++) {
+        if (i % 2 == 0) {
+          memcpy(out, value, runs[i] * sizeof(uint16_t));
+          value += runs[i];
+        } else {
+          memset(out, 0, runs[i] * sizeof(uint16_t));
+        }
+        out += runs[i];
+      }
+    }
+  });
+
+  return !corrupt;
+}
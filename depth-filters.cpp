@@ -0,0 +1,487 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <string.h>
+#include <stdlib.h>
+
+#include "simd-helpers.cpp"
+
+// Decimates a Z16 depth image by an integer factor, writing into dst (which is
+// only reallocated if its size changes). This does the same thing as
+// librealsense's decimation filter - the median of the non-zero pixels in each
+// patch for factors of 2 and 3, and their mean for larger factors - but works on
+// plain matrices, so recordings go through exactly the same code as the camera.
+//
+// If roi is given (in the decimated image's coordinates) only that part of dst is
+// filled in, and the rest is left as it was.
+void decimate_depth(const cv::Mat &src, cv::Mat &dst, int factor, cv::Rect roi = cv::Rect())
+{
+  assert(src.type() == CV_16UC1);
+  assert(factor >= 1);
+
+  int rows = src.rows / factor;
+  int cols = src.cols / factor;
+  dst.create(rows, cols, CV_16UC1);
+
+  if (roi.area() == 0) roi = cv::Rect(0, 0, cols, rows);
+
+  uint16_t patch[9];
+
+  for (int row = roi.y; row < roi.y + roi.height; row++) {
+    uint16_t *out = dst.ptr<uint16_t>(row);
+
+    for (int col = roi.x; col < roi.x + roi.width; col++) {
+      int patch_n = 0;
+      uint32_t patch_sum = 0;
+
+      for (int y = row * factor; y < (row + 1) * factor; y++) {
+        const uint16_t *in = src.ptr<uint16_t>(y) + col * factor;
+        for (int x = 0; x < factor; x++) {
+          uint16_t depth = in[x];
+          if (depth == 0) continue;
+
+          if (factor <= 3) patch[patch_n] = depth;
+          patch_sum += depth;
+          patch_n++;
+        }
+      }
+
+      if (patch_n == 0) {
+        out[col] = 0;
+      } else if (factor <= 3) {
+        std::nth_element(patch, patch + patch_n / 2, patch + patch_n);
+        out[col] = patch[patch_n / 2];
+      } else {
+        out[col] = patch_sum / patch_n;
+      }
+    }
+  }
+}
+
+// Fills each hole (a zero) with the nearest valid depth to its left. Holes at the
+// start of a row are left as they are.
+//
+// Rows are independent, so they're split across the cores. Within a row each pixel
+// depends on the one before it, but 8 lanes can still be filled in 3 steps: every
+// hole takes the value 1 lane to its left, then 2, then 4, which between them reach
+// back across the whole vector. Whatever is still a hole after that takes the last
+// lane of the previous vector.
+void hole_filling_filter(cv::Mat mat)
+{
+  assert(mat.type() == CV_16UC1);
+
+  cv::parallel_for_(cv::Range(0, mat.rows), [&](const cv::Range &rows) {
+    for (int row = rows.start; row < rows.end; row++) {
+      uint16_t *distances = mat.ptr<uint16_t>(row);
+      uint16_t previous = 0;
+      int col = 0;
+
+#if THESIS_SIMD
+      u16x8 carry = u16x8_zero();
+      for (; col + U16X8_LANES <= mat.cols; col += U16X8_LANES) {
+        u16x8 v = u16x8_load(distances + col);
+        v = u16x8_select(u16x8_eq_zero(v), u16x8_shift_up<1>(v), v);
+        v = u16x8_select(u16x8_eq_zero(v), u16x8_shift_up<2>(v), v);
+        v = u16x8_select(u16x8_eq_zero(v), u16x8_shift_up<4>(v), v);
+        v = u16x8_select(u16x8_eq_zero(v), carry, v);
+        carry = u16x8_broadcast_last(v);
+        u16x8_store(distances + col, v);
+      }
+      if (col > 0) previous = distances[col - 1];
+#endif
+
+      for (; col < mat.cols; col++) {
+        if (distances[col] == 0) distances[col] = previous;
+        previous = distances[col];
+      }
+    }
+  });
+}
+
+inline void sort_pair(uint16_t &a, uint16_t &b)
+{
+  uint16_t low = std::min(a, b);
+  b = std::max(a, b);
+  a = low;
+}
+
+#if THESIS_SIMD
+inline void sort_pair(u16x8 &a, u16x8 &b)
+{
+  u16x8 low = u16x8_min(a, b);
+  b = u16x8_max(a, b);
+  a = low;
+}
+#endif
+
+// the median of 25 values, using Devillard's 99 comparison sorting network.
+// This only puts the middle value in order, and works on single pixels or 8 at once
+template<typename T> inline T median_of_25(T *p)
+{
+  sort_pair(p[0], p[1]); sort_pair(p[3], p[4]); sort_pair(p[2], p[4]); sort_pair(p[2], p[3]); sort_pair(p[6], p[7]); sort_pair(p[5], p[7]);
+  sort_pair(p[5], p[6]); sort_pair(p[9], p[10]); sort_pair(p[8], p[10]); sort_pair(p[8], p[9]); sort_pair(p[12], p[13]); sort_pair(p[11], p[13]);
+  sort_pair(p[11], p[12]); sort_pair(p[15], p[16]); sort_pair(p[14], p[16]); sort_pair(p[14], p[15]); sort_pair(p[18], p[19]); sort_pair(p[17], p[19]);
+  sort_pair(p[17], p[18]); sort_pair(p[21], p[22]); sort_pair(p[20], p[22]); sort_pair(p[20], p[21]); sort_pair(p[23], p[24]); sort_pair(p[2], p[5]);
+  sort_pair(p[3], p[6]); sort_pair(p[0], p[6]); sort_pair(p[0], p[3]); sort_pair(p[4], p[7]); sort_pair(p[1], p[7]); sort_pair(p[1], p[4]);
+  sort_pair(p[11], p[14]); sort_pair(p[8], p[14]); sort_pair(p[8], p[11]); sort_pair(p[12], p[15]); sort_pair(p[9], p[15]); sort_pair(p[9], p[12]);
+  sort_pair(p[13], p[16]); sort_pair(p[10], p[16]); sort_pair(p[10], p[13]); sort_pair(p[20], p[23]); sort_pair(p[17], p[23]); sort_pair(p[17], p[20]);
+  sort_pair(p[21], p[24]); sort_pair(p[18], p[24]); sort_pair(p[18], p[21]); sort_pair(p[19], p[22]); sort_pair(p[8], p[17]); sort_pair(p[9], p[18]);
+  sort_pair(p[0], p[18]); sort_pair(p[0], p[9]); sort_pair(p[10], p[19]); sort_pair(p[1], p[19]); sort_pair(p[1], p[10]); sort_pair(p[11], p[20]);
+  sort_pair(p[2], p[20]); sort_pair(p[2], p[11]); sort_pair(p[12], p[21]); sort_pair(p[3], p[21]); sort_pair(p[3], p[12]); sort_pair(p[13], p[22]);
+  sort_pair(p[4], p[22]); sort_pair(p[4], p[13]); sort_pair(p[14], p[23]); sort_pair(p[5], p[23]); sort_pair(p[5], p[14]); sort_pair(p[15], p[24]);
+  sort_pair(p[6], p[24]); sort_pair(p[6], p[15]); sort_pair(p[7], p[16]); sort_pair(p[7], p[19]); sort_pair(p[13], p[21]); sort_pair(p[15], p[23]);
+  sort_pair(p[7], p[13]); sort_pair(p[7], p[15]); sort_pair(p[1], p[9]); sort_pair(p[3], p[11]); sort_pair(p[5], p[17]); sort_pair(p[11], p[17]);
+  sort_pair(p[9], p[17]); sort_pair(p[4], p[10]); sort_pair(p[6], p[12]); sort_pair(p[7], p[14]); sort_pair(p[4], p[6]); sort_pair(p[4], p[7]);
+  sort_pair(p[12], p[14]); sort_pair(p[10], p[14]); sort_pair(p[6], p[7]); sort_pair(p[10], p[12]); sort_pair(p[6], p[10]); sort_pair(p[6], p[17]);
+  sort_pair(p[12], p[17]); sort_pair(p[7], p[17]); sort_pair(p[7], p[10]); sort_pair(p[12], p[18]); sort_pair(p[7], p[12]); sort_pair(p[10], p[18]);
+  sort_pair(p[12], p[20]); sort_pair(p[10], p[20]); sort_pair(p[10], p[12]);
+  return p[12];
+}
+
+// A 5x5 median of a Z16 depth image into dst, with the edges replicated. This gives
+// exactly what cv::medianBlur(src, dst, 5) does, but we can vectorise it with the
+// same helpers as the rest of our filters and split it across the cores.
+//
+// Every output pixel runs the whole sorting network, 8 pixels at a time. Only the
+// two columns at either end of each row need their neighbours clamped, and they
+// (along with whatever doesn't fill a vector) go through the network one at a time.
+void median_filter_5x5(const cv::Mat &src, cv::Mat &dst)
+{
+  assert(src.type() == CV_16UC1);
+
+  dst.create(src.rows, src.cols, CV_16UC1);
+  assert(dst.data != src.data);
+
+  cv::parallel_for_(cv::Range(0, src.rows), [&](const cv::Range &rows) {
+    for (int row = rows.start; row < rows.end; row++) {
+      const uint16_t *in[5];
+      for (int dy = 0; dy < 5; dy++) {
+        int y = std::min(std::max(row + dy - 2, 0), src.rows - 1);
+        in[dy] = src.ptr<uint16_t>(y);
+      }
+      uint16_t *out = dst.ptr<uint16_t>(row);
+
+      int col = 0;
+      // the columns which need clamping on the left, and on the right from here
+      int clamped_to = std::min(2, src.cols);
+      int clamped_from = std::max(src.cols - 2, clamped_to);
+
+      while (col < src.cols) {
+#if THESIS_SIMD
+        if (col >= clamped_to && col + U16X8_LANES <= clamped_from) {
+          u16x8 p[25];
+          for (int dy = 0; dy < 5; dy++) {
+            for (int dx = 0; dx < 5; dx++) {
+              p[dy * 5 + dx] = u16x8_load(in[dy] + col + dx - 2);
+            }
+          }
+          u16x8_store(out + col, median_of_25(p));
+          col += U16X8_LANES;
+          continue;
+        }
+#endif
+        uint16_t p[25];
+        for (int dy = 0; dy < 5; dy++) {
+          for (int dx = 0; dx < 5; dx++) {
+            int x = std::min(std::max(col + dx - 2, 0), src.cols - 1);
+            p[dy * 5 + dx] = in[dy][x];
+          }
+        }
+        out[col] = median_of_25(p);
+        col++;
+      }
+    }
+  });
+}
+
+// The first depth (in millimetres) which cv::Mat::convertTo rounds up to each
+// whole number of meters. These are read back from OpenCV itself rather than
+// worked out, so that our rounding can't drift from its own
+#define MAX_METER_THRESHOLD 64
+
+std::vector<uint16_t> read_meter_thresholds()
+{
+  cv::Mat ramp(1, 65536, CV_16UC1), meters;
+  for (int depth = 0; depth < 65536; depth++) {
+    ramp.at<uint16_t>(0, depth) = depth;
+  }
+  ramp.convertTo(meters, CV_8U, 0.001);
+
+  std::vector<uint16_t> thresholds(MAX_METER_THRESHOLD + 1);
+  int depth = 0;
+  for (int meter = 0; meter <= MAX_METER_THRESHOLD; meter++) {
+    while (meters.at<uint8_t>(0, depth) < meter) depth++;
+    thresholds[meter] = depth;
+  }
+  return thresholds;
+}
+
+const uint16_t *get_meter_thresholds()
+{
+  // read on first use, which is thread safe as of C++11
+  static std::vector<uint16_t> thresholds = read_meter_thresholds();
+  return &thresholds[0];
+}
+
+// the depth of a row in whole meters up to max_meters, with a column either side
+// reflected in from the row (so padded[0] is column 1 again)
+void quantise_row(const uint16_t *in, uint16_t *padded, int cols, int max_meters)
+{
+  const uint16_t *thresholds = get_meter_thresholds();
+  uint16_t *out = padded + 1;
+  int col = 0;
+
+#if THESIS_SIMD
+  for (; col + U16X8_LANES <= cols; col += U16X8_LANES) {
+    u16x8 depth = u16x8_load(in + col);
+    u16x8 meters = u16x8_zero();
+    for (int meter = 1; meter <= max_meters; meter++) {
+      u16x8 reached = u16x8_ge(depth, u16x8_set1(thresholds[meter]));
+      meters = u16x8_add(meters, u16x8_and(reached, u16x8_set1(1)));
+    }
+    u16x8_store(out + col, meters);
+  }
+#endif
+
+  for (; col < cols; col++) {
+    uint16_t meters = 0;
+    for (int meter = 1; meter <= max_meters; meter++) {
+      if (in[col] >= thresholds[meter]) meters++;
+    }
+    out[col] = meters;
+  }
+
+  out[-1] = out[std::min(1, cols - 1)];
+  out[cols] = out[std::max(cols - 2, 0)];
+}
+
+// the same, but keeping the depth in millimetres and clamping it to max_millimetres
+void clamp_row(const uint16_t *in, uint16_t *padded, int cols, uint16_t max_millimetres)
+{
+  uint16_t *out = padded + 1;
+  int col = 0;
+
+#if THESIS_SIMD
+  u16x8 max_depth = u16x8_set1(max_millimetres);
+  for (; col + U16X8_LANES <= cols; col += U16X8_LANES) {
+    u16x8_store(out + col, u16x8_min(u16x8_load(in + col), max_depth));
+  }
+#endif
+
+  for (; col < cols; col++) {
+    out[col] = std::min(in[col], max_millimetres);
+  }
+
+  out[-1] = out[std::min(1, cols - 1)];
+  out[cols] = out[std::max(cols - 2, 0)];
+}
+
+// Which pixels of a row the 3x3 Laplacian would give more than 2 * threshold. The
+// kernel is [2 0 2; 0 -8 0; 2 0 2], so that's where the diagonal neighbours add up
+// to more than 4 times the pixel plus the threshold. Edges are all ones, and there's
+// a column of zeros either side. The rows have to be small enough that 4 of them add
+// up to less than 65536 with the threshold
+void laplacian_row(const uint16_t *above, const uint16_t *row, const uint16_t *below, uint16_t *padded, int cols,
+  uint16_t threshold)
+{
+  // skip over the reflected columns
+  above++;
+  row++;
+  below++;
+  uint16_t *out = padded + 1;
+  int col = 0;
+
+#if THESIS_SIMD
+  for (; col + U16X8_LANES <= cols; col += U16X8_LANES) {
+    u16x8 diagonals = u16x8_add(
+      u16x8_add(u16x8_load(above + col - 1), u16x8_load(above + col + 1)),
+      u16x8_add(u16x8_load(below + col - 1), u16x8_load(below + col + 1)));
+    u16x8 centre = u16x8_load(row + col);
+    u16x8 centre_4 = u16x8_add(u16x8_add(centre, centre), u16x8_add(centre, centre));
+    u16x8_store(out + col, u16x8_ge(diagonals, u16x8_add(centre_4, u16x8_set1(threshold + 1))));
+  }
+#endif
+
+  for (; col < cols; col++) {
+    int diagonals = above[col - 1] + above[col + 1] + below[col - 1] + below[col + 1];
+    out[col] = diagonals > 4 * row[col] + threshold ? 0xFFFF : 0;
+  }
+
+  out[-1] = 0;
+  out[cols] = 0;
+}
+
+// Which pixels of a row have a 3x3 Sobel gradient with |x| + |y| above threshold.
+// Each of x and y is worked out as the difference of two sums, so it only ever
+// deals with positive numbers, and the rows have to be small enough that 8 of
+// them add up to less than 65536
+void sobel_row(const uint16_t *above, const uint16_t *row, const uint16_t *below, uint16_t *padded, int cols,
+  uint16_t threshold)
+{
+  above++;
+  row++;
+  below++;
+  uint16_t *out = padded + 1;
+  int col = 0;
+
+#if THESIS_SIMD
+  for (; col + U16X8_LANES <= cols; col += U16X8_LANES) {
+    u16x8 above_left = u16x8_load(above + col - 1), above_right = u16x8_load(above + col + 1);
+    u16x8 below_left = u16x8_load(below + col - 1), below_right = u16x8_load(below + col + 1);
+    u16x8 row_left = u16x8_load(row + col - 1), row_right = u16x8_load(row + col + 1);
+    u16x8 above_middle = u16x8_load(above + col), below_middle = u16x8_load(below + col);
+
+    u16x8 left = u16x8_add(u16x8_add(above_left, below_left), u16x8_add(row_left, row_left));
+    u16x8 right = u16x8_add(u16x8_add(above_right, below_right), u16x8_add(row_right, row_right));
+    u16x8 top = u16x8_add(u16x8_add(above_left, above_right), u16x8_add(above_middle, above_middle));
+    u16x8 bottom = u16x8_add(u16x8_add(below_left, below_right), u16x8_add(below_middle, below_middle));
+
+    u16x8 x = u16x8_sub(u16x8_max(left, right), u16x8_min(left, right));
+    u16x8 y = u16x8_sub(u16x8_max(top, bottom), u16x8_min(top, bottom));
+    u16x8_store(out + col, u16x8_ge(u16x8_add(x, y), u16x8_set1(threshold + 1)));
+  }
+#endif
+
+  for (; col < cols; col++) {
+    int x = (above[col + 1] + 2 * row[col + 1] + below[col + 1]) - (above[col - 1] + 2 * row[col - 1] + below[col - 1]);
+    int y = (below[col - 1] + 2 * below[col] + below[col + 1]) - (above[col - 1] + 2 * above[col] + above[col + 1]);
+    out[col] = abs(x) + abs(y) > threshold ? 0xFFFF : 0;
+  }
+
+  out[-1] = 0;
+  out[cols] = 0;
+}
+
+// dilates the edges by a 3x3 cross, and marks everything they don't reach with a 1
+void dilate_invert_row(const uint16_t *above, const uint16_t *row, const uint16_t *below, uint8_t *out, int cols)
+{
+  above++;
+  row++;
+  below++;
+  int col = 0;
+
+#if THESIS_SIMD
+  for (; col + U16X8_LANES <= cols; col += U16X8_LANES) {
+    u16x8 edges = u16x8_or(
+      u16x8_or(u16x8_load(above + col), u16x8_load(below + col)),
+      u16x8_or(u16x8_load(row + col), u16x8_or(u16x8_load(row + col - 1), u16x8_load(row + col + 1))));
+    u16x8_store_u8(out + col, u16x8_and(u16x8_eq_zero(edges), u16x8_set1(1)));
+  }
+#endif
+
+  for (; col < cols; col++) {
+    bool edge = above[col] || below[col] || row[col - 1] || row[col] || row[col + 1];
+    out[col] = edge ? 0 : 1;
+  }
+}
+
+// How the edges between objects are found. EDGE_METERS is what we've always done:
+// the depth is rounded to whole meters first, so only steps of around a meter show
+// up. The others work on the depth in millimetres, so kerbs and stairs make edges
+// too, at the same cost. EDGE_LAPLACIAN keeps the same kernel (and so only marks the
+// nearer side of a step), and EDGE_SOBEL marks any steep enough gradient.
+enum edge_mode {EDGE_METERS, EDGE_LAPLACIAN, EDGE_SOBEL};
+
+// the smallest steps found in millimetres. A step of s between two regions gives
+// the Laplacian 2s (for the sum of the diagonal differences), and the Sobel 4s
+#define LAPLACIAN_EDGE_MM 200
+#define SOBEL_EDGE_MM 400
+
+edge_mode edge_detector = EDGE_METERS;
+
+// picks the edge mode from the command line
+void parse_edge_mode(const char *mode)
+{
+  if (strcmp(mode, "meters") == 0) {
+    edge_detector = EDGE_METERS;
+  } else if (strcmp(mode, "laplacian") == 0) {
+    edge_detector = EDGE_LAPLACIAN;
+  } else if (strcmp(mode, "sobel") == 0) {
+    edge_detector = EDGE_SOBEL;
+  } else {
+    throw std::runtime_error(std::string("Unknown edge mode ") + mode);
+  }
+}
+
+// Builds the mask of the regions enclosed by edges from a frame in millimetres:
+// 1 inside a region and 0 on an edge, with the depth clamped to max_meters. With
+// EDGE_METERS this is exactly what we used to get from
+//   convertTo(meters, CV_8U, 0.001), clamping to max_meters,
+//   cv::Laplacian(meters, edges, CV_8U, 3), cv::dilate(edges, edges, 3x3 ellipse)
+//   and turning the edges into 0s and everything else into 1s
+// but in one sweep down the frame. Each strip of rows keeps the last 3 rows of
+// depth and edges, so nothing but the mask is written out.
+void build_edge_mask(const cv::Mat &distances, cv::Mat &mask, int max_meters, edge_mode mode = EDGE_METERS)
+{
+  assert(distances.type() == CV_16UC1);
+  assert(max_meters <= MAX_METER_THRESHOLD);
+  // so the Sobel's sums fit in 16 bits
+  assert(max_meters * 1000 * 8 < 65536);
+
+  int rows = distances.rows;
+  int cols = distances.cols;
+  mask.create(rows, cols, CV_8UC1);
+
+  cv::parallel_for_(cv::Range(0, rows), [&](const cv::Range &strip) {
+    // the last rows of depth and edges, each with its padding column either side,
+    // and which row each holds
+    std::vector<uint16_t> depths(3 * (cols + 2)), edges(3 * (cols + 2));
+    int depth_rows[3] = {-1, -1, -1};
+    int edge_rows[3] = {-1, -1, -1};
+    std::vector<uint16_t> no_edges(cols + 2, 0);
+
+    // rows reflect at the top and bottom of the frame, as with BORDER_REFLECT_101
+    auto get_depths = [&](int row) -> const uint16_t * {
+      if (row < 0) row = std::min(1, rows - 1);
+      if (row >= rows) row = std::max(rows - 2, 0);
+
+      uint16_t *slot = &depths[(row % 3) * (cols + 2)];
+      if (depth_rows[row % 3] != row) {
+        if (mode == EDGE_METERS) {
+          quantise_row(distances.ptr<uint16_t>(row), slot, cols, max_meters);
+        } else {
+          clamp_row(distances.ptr<uint16_t>(row), slot, cols, max_meters * 1000);
+        }
+        depth_rows[row % 3] = row;
+      }
+      return slot;
+    };
+
+    // while the dilation doesn't look outside the frame at all
+    auto get_edges = [&](int row) -> const uint16_t * {
+      if (row < 0 || row >= rows) return &no_edges[0];
+
+      uint16_t *slot = &edges[(row % 3) * (cols + 2)];
+      if (edge_rows[row % 3] != row) {
+        const uint16_t *above = get_depths(row - 1);
+        const uint16_t *middle = get_depths(row);
+        const uint16_t *below = get_depths(row + 1);
+
+        switch (mode) {
+          case EDGE_METERS:
+            laplacian_row(above, middle, below, slot, cols, 0);
+            break;
+          case EDGE_LAPLACIAN:
+            laplacian_row(above, middle, below, slot, cols, LAPLACIAN_EDGE_MM);
+            break;
+          case EDGE_SOBEL:
+            sobel_row(above, middle, below, slot, cols, SOBEL_EDGE_MM);
+            break;
+        }
+        edge_rows[row % 3] = row;
+      }
+      return slot;
+    };
+
+    for (int row = strip.start; row < strip.end; row++) {
+      const uint16_t *above = get_edges(row - 1);
+      const uint16_t *middle = get_edges(row);
+      const uint16_t *below = get_edges(row + 1);
+      dilate_invert_row(above, middle, below, mask.ptr<uint8_t>(row), cols);
+    }
+  });
+}
@@ -0,0 +1,518 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <limits.h>             // for IOV_MAX
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/uio.h>            // for writev
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "control.cpp"
+
+// Field recordings are written as a sequence of chunks, each holding one or more
+// depth frames, followed by an index of every frame once the recording is closed:
+//
+//   recording_file_header
+//   chunk: recording_chunk_header, recording_frame_entry x frame_count,
+//          padding, then each frame's payload padded to RECORDING_ALIGNMENT
+//   chunk ...
+//   recording_frame_entry x frame count (the index)
+//   recording_footer
+//
+// The file is only ever appended to. If the recorder never gets to write the index
+// (e.g. the battery goes flat), replay rebuilds it by walking the chunks instead.
+// Payloads are aligned so that replay can point matrices straight into the mapping.
+// Each chunk says which codec its payloads use - raw chunks are replayed without
+// copying, while compressed chunks are decoded as they are replayed.
+
+#define RECORDING_MAGIC "THDEPTH1"
+#define RECORDING_CHUNK_MAGIC "CHNK"
+#define RECORDING_INDEX_MAGIC "THDINDEX"
+#define RECORDING_VERSION 2
+#define RECORDING_ALIGNMENT 64
+
+// how many frames may be waiting for the writer thread before new ones are dropped.
+// each of these is a copy of the frame, so this is kept small
+#define RECORDING_QUEUE_LENGTH 8
+// the writer thread writes everything it has queued up as a single chunk, up to this many frames
+#define RECORDING_CHUNK_MAX_FRAMES 8
+
+// how each chunk's payloads are stored - see depth-codec.cpp for the others
+#define DEPTH_CODEC_RAW 0
+
+struct recording_file_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  float depth_scale;
+  float fx, fy, ppx, ppy;
+  int32_t distortion_model;
+  float coeffs[5];
+};
+
+struct recording_chunk_header
+{
+  char magic[4];
+  uint32_t codec;
+  uint32_t frame_count;
+  uint32_t reserved;
+};
+
+// describes a single frame, both in its chunk and in the index at the end of the file
+struct recording_frame_entry
+{
+  uint64_t frame_number;
+  double timestamp_ms;
+  // from the start of the file
+  uint64_t payload_offset;
+  uint32_t payload_bytes;
+  uint32_t codec;
+  // see depth_frame_data
+  float gravity[3];
+  uint32_t reserved;
+};
+
+struct recording_footer
+{
+  char magic[8];
+  uint64_t index_offset;
+  uint64_t frame_count;
+};
+
+uint64_t align_recording_offset(uint64_t offset)
+{
+  return (offset + RECORDING_ALIGNMENT - 1) / RECORDING_ALIGNMENT * RECORDING_ALIGNMENT;
+}
+
+// Streams depth frames to a recording on a background thread. push() copies the
+// depth into a buffer of the queue's own, so the camera gets its frame back
+// straight away rather than running out of them while the SD card catches up. The
+// buffers are swapped between the queue and the chunk being written rather than
+// freed, so after the first few frames nothing is allocated, and the sampling
+// thread never waits on the SD card.
+//
+// If a write fails, the recorder stops there rather than carrying on with offsets
+// that no longer match the file. What was written up to then can still be replayed,
+// as the chunks are found by scanning when there's no index.
+class depth_recorder
+{
+  int fd;
+  uint32_t codec;
+  // compressed payloads for the chunk being written, kept between chunks
+  std::vector<uint8_t> encoded[RECORDING_CHUNK_MAX_FRAMES];
+  uint64_t file_offset;
+  std::vector<recording_frame_entry> index;
+
+  std::thread writer_thread;
+  std::mutex queue_mutex;
+  std::condition_variable queue_cv;
+  depth_frame_data queue[RECORDING_QUEUE_LENGTH];
+  int queue_head;
+  int queue_count;
+  bool closing;
+  // set by the writer thread when a write fails, after which nothing more is written
+  std::atomic<bool> failed;
+
+  static const uint8_t padding[RECORDING_ALIGNMENT];
+
+  // returns false, having reported it, if the write failed
+  bool write_fully(struct iovec *iov, int iov_count)
+  {
+    while (iov_count > 0) {
+      ssize_t written = writev(fd, iov, iov_count > IOV_MAX ? IOV_MAX : iov_count);
+      if (written < 0) {
+        if (errno == EINTR) continue;
+        failed = true;
+        screen.post("Recording stopped, as writing to it failed: %s\n", strerror(errno));
+        return false;
+      }
+      file_offset += written;
+
+      // skip past whatever was written, which may end part way through an iovec
+      while (iov_count > 0 && (size_t)written >= iov->iov_len) {
+        written -= iov->iov_len;
+        iov++;
+        iov_count--;
+      }
+      if (iov_count > 0) {
+        iov->iov_base = (uint8_t *)iov->iov_base + written;
+        iov->iov_len -= written;
+      }
+    }
+    return true;
+  }
+
+  void add_padding(std::vector<struct iovec> &iov, uint64_t &offset)
+  {
+    uint64_t aligned = align_recording_offset(offset);
+    if (aligned != offset) {
+      struct iovec pad = { (void *)padding, (size_t)(aligned - offset) };
+      iov.push_back(pad);
+      offset = aligned;
+    }
+  }
+
+  void write_chunk(depth_frame_data *frames, int frame_count)
+  {
+    recording_chunk_header header;
+    memcpy(header.magic, RECORDING_CHUNK_MAGIC, 4);
+    header.codec = codec;
+    header.frame_count = frame_count;
+    header.reserved = 0;
+
+    recording_frame_entry entries[RECORDING_CHUNK_MAX_FRAMES];
+    std::vector<struct iovec> iov;
+    iov.reserve(2 + 2 * RECORDING_CHUNK_MAX_FRAMES + 1);
+
+    struct iovec header_iov = { &header, sizeof(header) };
+    struct iovec entries_iov = { entries, frame_count * sizeof(recording_frame_entry) };
+    iov.push_back(header_iov);
+    iov.push_back(entries_iov);
+
+    uint64_t offset = file_offset + sizeof(header) + frame_count * sizeof(recording_frame_entry);
+    add_padding(iov, offset);
+
+    for (int i = 0; i < frame_count; i++) {
+      const cv::Mat &depth = frames[i].depth;
+      assert(depth.isContinuous());
+
+      entries[i].frame_number = frames[i].frame_number;
+      entries[i].timestamp_ms = frames[i].timestamp_ms;
+      entries[i].payload_offset = offset;
+      entries[i].codec = header.codec;
+      memcpy(entries[i].gravity, frames[i].gravity, sizeof(entries[i].gravity));
+      entries[i].reserved = 0;
+
+      struct iovec payload;
+      if (codec == DEPTH_CODEC_DELTA_RLE) {
+        encoded[i].resize(depth_codec_max_encoded_size(depth.cols, depth.rows));
+        entries[i].payload_bytes = encode_depth_delta_rle(depth, &encoded[i][0]);
+        payload.iov_base = &encoded[i][0];
+      } else {
+        entries[i].payload_bytes = depth.total() * depth.elemSize();
+        payload.iov_base = depth.data;
+      }
+      payload.iov_len = entries[i].payload_bytes;
+      iov.push_back(payload);
+      offset += entries[i].payload_bytes;
+      add_padding(iov, offset);
+    }
+
+    if (!write_fully(&iov[0], iov.size())) return;
+    index.insert(index.end(), entries, entries + frame_count);
+    frames_written += frame_count;
+  }
+
+  void writer_loop()
+  {
+    depth_frame_data chunk[RECORDING_CHUNK_MAX_FRAMES];
+
+    while (1) {
+      int chunk_count = 0;
+      {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        queue_cv.wait(lock, [this] { return queue_count > 0 || closing; });
+        if ((queue_count == 0 && closing) || failed) break;
+
+        while (queue_count > 0 && chunk_count < RECORDING_CHUNK_MAX_FRAMES) {
+          std::swap(chunk[chunk_count++], queue[queue_head]);
+          queue_head = (queue_head + 1) % RECORDING_QUEUE_LENGTH;
+          queue_count--;
+        }
+      }
+
+      write_chunk(chunk, chunk_count);
+    }
+  }
+
+public:
+  // statistics for display
+  std::atomic<unsigned long> frames_written;
+  std::atomic<unsigned long> frames_dropped;
+
+  depth_recorder(const char *path, const rs2_intrinsics &intrinsics, float depth_scale, uint32_t codec)
+    : codec(codec), file_offset(0), queue_head(0), queue_count(0), closing(false), failed(false),
+      frames_written(0), frames_dropped(0)
+  {
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      throw std::runtime_error(std::string("Can't create recording ") + path);
+    }
+
+    recording_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RECORDING_MAGIC, 8);
+    header.version = RECORDING_VERSION;
+    header.width = intrinsics.width;
+    header.height = intrinsics.height;
+    header.depth_scale = depth_scale;
+    header.fx = intrinsics.fx;
+    header.fy = intrinsics.fy;
+    header.ppx = intrinsics.ppx;
+    header.ppy = intrinsics.ppy;
+    header.distortion_model = intrinsics.model;
+    memcpy(header.coeffs, intrinsics.coeffs, sizeof(header.coeffs));
+
+    struct iovec iov[2] = { { &header, sizeof(header) }, { (void *)padding, 0 } };
+    iov[1].iov_len = align_recording_offset(sizeof(header)) - sizeof(header);
+    write_fully(iov, 2);
+
+    // around 10 minutes at 30fps before the index needs to grow
+    index.reserve(18000);
+    writer_thread = std::thread(&depth_recorder::writer_loop, this);
+  }
+
+  ~depth_recorder()
+  {
+    close_recording();
+  }
+
+  // queues a copy of a frame for writing. This never blocks on the disk - if the
+  // writer has fallen behind, the frame is dropped instead
+  void push(const depth_frame_data &frame)
+  {
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex);
+      if (closing || failed) return;
+      if (queue_count == RECORDING_QUEUE_LENGTH) {
+        frames_dropped++;
+        return;
+      }
+      depth_frame_data &queued = queue[(queue_head + queue_count) % RECORDING_QUEUE_LENGTH];
+      frame.depth.copyTo(queued.depth);
+      queued.depth_scale = frame.depth_scale;
+      queued.timestamp_ms = frame.timestamp_ms;
+      queued.frame_number = frame.frame_number;
+      memcpy(queued.gravity, frame.gravity, sizeof(queued.gravity));
+      queue_count++;
+    }
+    queue_cv.notify_one();
+  }
+
+  // waits for the queued frames to be written, then writes the index and footer
+  void close_recording()
+  {
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex);
+      if (closing) return;
+      closing = true;
+    }
+    queue_cv.notify_one();
+    writer_thread.join();
+
+    // the index would only point into a file we couldn't finish writing
+    if (failed) {
+      close(fd);
+      return;
+    }
+
+    recording_footer footer;
+    memcpy(footer.magic, RECORDING_INDEX_MAGIC, 8);
+    footer.index_offset = file_offset;
+    footer.frame_count = index.size();
+
+    struct iovec iov[2] = {
+      { index.empty() ? NULL : &index[0], index.size() * sizeof(recording_frame_entry) },
+      { &footer, sizeof(footer) }
+    };
+    write_fully(iov, 2);
+    close(fd);
+  }
+
+  // for after the recording is closed
+  void print_stats()
+  {
+    printf("Recorded %lu frames, dropped %lu as the writer fell behind", frames_written.load(), frames_dropped.load());
+    if (failed) printf(", and stopped after a write failed");
+    printf("\n");
+  }
+};
+
+const uint8_t depth_recorder::padding[RECORDING_ALIGNMENT] = {};
+
+// set from the command line - when set, every frame from the camera is recorded here
+const char *record_path = NULL;
+uint32_t record_codec = DEPTH_CODEC_DELTA_RLE;
+depth_recorder *recorder = NULL;
+
+// accepts "raw" or "delta"
+void parse_record_codec(const char *arg)
+{
+  if (strcmp(arg, "raw") == 0) {
+    record_codec = DEPTH_CODEC_RAW;
+  } else if (strcmp(arg, "delta") == 0) {
+    record_codec = DEPTH_CODEC_DELTA_RLE;
+  } else {
+    throw std::runtime_error(std::string("Unknown recording codec: ") + arg);
+  }
+}
+
+// starts recording every frame handed out by the given source
+void start_recording(frame_source *frames, const char *path)
+{
+  recorder = new depth_recorder(path, frames->get_intrinsics(), frames->get_depth_scale(), record_codec);
+  frames->set_frame_observer([](const depth_frame_data &frame) { recorder->push(frame); });
+}
+
+void stop_recording(frame_source *frames)
+{
+  if (recorder == NULL) return;
+  // waits for the camera's thread to be out of the observer, so nothing is pushed
+  // while the recording is closed
+  frames->set_frame_observer(nullptr);
+  recorder->close_recording();
+  recorder->print_stats();
+}
+
+// replays recordings written by depth_recorder. Frames point straight into the
+// mapped file, so nothing is copied
+class recording_replay_frame_source : public replay_frame_source
+{
+  std::shared_ptr<mapped_file> mapping;
+  const recording_frame_entry *index;
+  size_t frame_count;
+  // only used if the recording was never closed and the index has to be rebuilt
+  std::vector<recording_frame_entry> scanned_index;
+
+  // whether an entry's payload lies entirely before end
+  static bool payload_in_bounds(const recording_frame_entry &entry, uint64_t end)
+  {
+    return entry.payload_offset <= end && entry.payload_bytes <= end - entry.payload_offset;
+  }
+
+  // whether the index the footer points to, and every payload in it, are within the
+  // file. A file can still be cut short or damaged after it was closed
+  bool index_in_bounds(const recording_footer *footer)
+  {
+    uint64_t index_end = mapping->length - sizeof(recording_footer);
+    if (footer->index_offset < sizeof(recording_file_header) || footer->index_offset > index_end ||
+        footer->frame_count > (index_end - footer->index_offset) / sizeof(recording_frame_entry)) {
+      return false;
+    }
+
+    const recording_frame_entry *entries = (const recording_frame_entry *)(mapping->data + footer->index_offset);
+    for (uint64_t i = 0; i < footer->frame_count; i++) {
+      if (!payload_in_bounds(entries[i], footer->index_offset)) return false;
+    }
+    return true;
+  }
+
+  // walks the chunks from the start of the file. This stops at the first chunk
+  // which is incomplete, which is where the recorder was when it was cut off
+  void scan_chunks()
+  {
+    uint64_t offset = align_recording_offset(sizeof(recording_file_header));
+
+    while (offset + sizeof(recording_chunk_header) <= mapping->length) {
+      const recording_chunk_header *chunk = (const recording_chunk_header *)(mapping->data + offset);
+      if (memcmp(chunk->magic, RECORDING_CHUNK_MAGIC, 4) != 0) break;
+
+      const recording_frame_entry *entries = (const recording_frame_entry *)(chunk + 1);
+      uint64_t chunk_end = offset + sizeof(recording_chunk_header) + chunk->frame_count * sizeof(recording_frame_entry);
+      if (chunk_end > mapping->length) break;
+
+      bool complete = true;
+      for (uint32_t i = 0; i < chunk->frame_count; i++) {
+        if (!payload_in_bounds(entries[i], mapping->length)) {
+          complete = false;
+          break;
+        }
+        chunk_end = std::max(chunk_end, entries[i].payload_offset + entries[i].payload_bytes);
+      }
+      if (!complete) break;
+
+      scanned_index.insert(scanned_index.end(), entries, entries + chunk->frame_count);
+      offset = align_recording_offset(chunk_end);
+    }
+
+    index = scanned_index.empty() ? NULL : &scanned_index[0];
+    frame_count = scanned_index.size();
+  }
+
+public:
+  recording_replay_frame_source(const char *path)
+  {
+    mapping = std::make_shared<mapped_file>(path);
+
+    const recording_file_header *header = (const recording_file_header *)mapping->data;
+    if (mapping->length < sizeof(recording_file_header) ||
+        memcmp(header->magic, RECORDING_MAGIC, 8) != 0 ||
+        header->version != RECORDING_VERSION) {
+      throw std::runtime_error(std::string("Not a depth recording: ") + path);
+    }
+
+    intrinsics = rs2_intrinsics();
+    intrinsics.width = header->width;
+    intrinsics.height = header->height;
+    intrinsics.fx = header->fx;
+    intrinsics.fy = header->fy;
+    intrinsics.ppx = header->ppx;
+    intrinsics.ppy = header->ppy;
+    intrinsics.model = (rs2_distortion)header->distortion_model;
+    memcpy(intrinsics.coeffs, header->coeffs, sizeof(intrinsics.coeffs));
+    depth_scale = header->depth_scale;
+
+    // a footer whose index doesn't fit in the file is ignored, and the chunks are
+    // scanned instead as if the recording had never been closed
+    const recording_footer *footer = (const recording_footer *)(mapping->data + mapping->length - sizeof(recording_footer));
+    if (mapping->length >= sizeof(recording_file_header) + sizeof(recording_footer) &&
+        memcmp(footer->magic, RECORDING_INDEX_MAGIC, 8) == 0 && index_in_bounds(footer)) {
+      index = (const recording_frame_entry *)(mapping->data + footer->index_offset);
+      frame_count = footer->frame_count;
+    } else {
+      scan_chunks();
+    }
+  }
+
+protected:
+  size_t get_frame_count()
+  {
+    return frame_count;
+  }
+
+  double get_frame_timestamp(size_t frame_index)
+  {
+    return index[frame_index].timestamp_ms;
+  }
+
+  void load_frame(size_t frame_index, depth_frame_data &frame)
+  {
+    const recording_frame_entry &entry = index[frame_index];
+    const uint8_t *payload = mapping->data + entry.payload_offset;
+
+    switch (entry.codec) {
+      case DEPTH_CODEC_RAW:
+        if (entry.payload_bytes != (uint64_t)intrinsics.width * intrinsics.height * sizeof(uint16_t)) {
+          throw std::runtime_error("Recording is corrupt");
+        }
+        frame.depth = cv::Mat(intrinsics.height, intrinsics.width, CV_16UC1, (void *)payload);
+        frame.owner = mapping;
+        break;
+      case DEPTH_CODEC_DELTA_RLE:
+        // the previous frame may still be in use, so this can't decode over it
+        frame.depth = cv::Mat(intrinsics.height, intrinsics.width, CV_16UC1);
+        frame.owner.reset();
+        if (!decode_depth_delta_rle(payload, entry.payload_bytes, frame.depth)) {
+          throw std::runtime_error("Recording is corrupt");
+        }
+        break;
+      default:
+        throw std::runtime_error("Recording uses an unknown depth codec");
+    }
+
+    frame.timestamp_ms = entry.timestamp_ms;
+    frame.frame_number = entry.frame_number;
+    frame.color = cv::Mat();
+    memcpy(frame.gravity, entry.gravity, sizeof(frame.gravity));
+  }
+};
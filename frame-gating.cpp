@@ -0,0 +1,128 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <algorithm>
+#include <stdlib.h>
+
+// Decides whether a frame is worth processing while we're watching for obstacles.
+// If the user is standing still, most frames are the same as the last one we
+// classified, and running the whole pipeline again only costs battery and takes
+// CPU away from the audio thread.
+//
+// Each frame is reduced to a thumbnail of the mean depth in a grid of tiles,
+// reading only every GATE_SAMPLE_STEP'th pixel of every GATE_SAMPLE_STEP'th row.
+// This is compared against the thumbnail of the last frame that was processed
+// (rather than the frame before, so slow changes still add up), and the frame is
+// only processed if some tile has moved by more than the noise. Every
+// GATE_MAX_SKIPPED frames one is processed anyway, in case something crept in
+// below the thresholds.
+
+#define GATE_TILE_COLUMNS 16
+#define GATE_TILE_ROWS 12
+#define GATE_SAMPLE_STEP 4
+// a tile has changed if its mean moves by more than this percentage of its depth,
+// or this many millimetres, whichever is more
+#define GATE_CHANGE_PERCENT 3
+#define GATE_MIN_CHANGE_MM 40
+// or if more than this percentage of its samples have gained or lost their depth
+#define GATE_HOLE_CHANGE_PERCENT 20
+#define GATE_MAX_SKIPPED 15
+
+// turned off by --process-every-frame
+bool use_frame_gating = true;
+
+class change_detector
+{
+  struct tile
+  {
+    uint16_t mean;
+    uint16_t valid;  // samples with a depth
+    uint16_t samples;
+  };
+
+  std::vector<tile> reference;
+  std::vector<tile> current;
+  // the sums for one row of tiles
+  std::vector<uint32_t> sums;
+  std::vector<uint16_t> valid;
+  std::vector<uint16_t> samples;
+  int skipped_in_a_row = 0;
+
+  void build_thumbnail(const cv::Mat &depth)
+  {
+    current.resize(GATE_TILE_COLUMNS * GATE_TILE_ROWS);
+
+    for (int tile_row = 0; tile_row < GATE_TILE_ROWS; tile_row++) {
+      sums.assign(GATE_TILE_COLUMNS, 0);
+      valid.assign(GATE_TILE_COLUMNS, 0);
+      samples.assign(GATE_TILE_COLUMNS, 0);
+
+      int row_end = (tile_row + 1) * depth.rows / GATE_TILE_ROWS;
+      for (int row = tile_row * depth.rows / GATE_TILE_ROWS; row < row_end; row += GATE_SAMPLE_STEP) {
+        const uint16_t *in = depth.ptr<uint16_t>(row);
+        int tile_col = 0;
+        int tile_end = depth.cols / GATE_TILE_COLUMNS;
+        for (int col = 0; col < depth.cols; col += GATE_SAMPLE_STEP) {
+          while (col >= tile_end) {
+            tile_col++;
+            tile_end = (tile_col + 1) * depth.cols / GATE_TILE_COLUMNS;
+          }
+          sums[tile_col] += in[col];
+          valid[tile_col] += in[col] != 0;
+          samples[tile_col]++;
+        }
+      }
+
+      for (int tile_col = 0; tile_col < GATE_TILE_COLUMNS; tile_col++) {
+        tile &t = current[tile_row * GATE_TILE_COLUMNS + tile_col];
+        t.mean = valid[tile_col] > 0 ? sums[tile_col] / valid[tile_col] : 0;
+        t.valid = valid[tile_col];
+        t.samples = samples[tile_col];
+      }
+    }
+  }
+
+  bool changed_since_reference(float depth_scale)
+  {
+    if (reference.size() != current.size()) return true;
+
+    // in the frame's own units
+    float min_change = GATE_MIN_CHANGE_MM * 0.001f / depth_scale;
+
+    for (size_t i = 0; i < current.size(); i++) {
+      const tile &now = current[i];
+      const tile &then = reference[i];
+      if (now.samples != then.samples) return true;
+
+      if (abs(now.valid - then.valid) * 100 > GATE_HOLE_CHANGE_PERCENT * now.samples) return true;
+      float threshold = std::max(min_change, then.mean * GATE_CHANGE_PERCENT / 100.0f);
+      if (abs(now.mean - then.mean) > threshold) return true;
+    }
+    return false;
+  }
+
+public:
+  // statistics for display
+  unsigned long frames_checked = 0;
+  unsigned long frames_skipped = 0;
+
+  // whether depth (in the camera's units of depth_scale meters) should be processed.
+  // A forced frame is always processed, and like any other processed frame it
+  // becomes what later frames are compared against
+  bool should_process(const cv::Mat &depth, float depth_scale, bool force)
+  {
+    build_thumbnail(depth);
+    frames_checked++;
+
+    if (!force && skipped_in_a_row < GATE_MAX_SKIPPED && !changed_since_reference(depth_scale)) {
+      skipped_in_a_row++;
+      frames_skipped++;
+      return false;
+    }
+
+    std::swap(reference, current);
+    skipped_in_a_row = 0;
+    return true;
+  }
+};
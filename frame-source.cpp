@@ -0,0 +1,658 @@
+#pragma once
+
+#include <librealsense2/rs.hpp> // Include RealSense Cross Platform API
+#include <opencv2/opencv.hpp>   // Include OpenCV API
+#include <memory>
+#include <functional>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <fcntl.h>              // for mmap'ing recordings
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// the RealSense viewer doesn't write a frame rate into its metadata, so
+// single-frame .raw dumps are assumed to have been captured at this rate
+#define REPLAY_DEFAULT_FPS 30
+
+// the D435i reports depth in millimetres unless the depth units have been changed
+#define DEFAULT_DEPTH_SCALE 0.001f
+
+// we will attempt to decimate down to this width, but decimation is an integer value
+// so the actual decimated width may be slightly different.
+#define DESIRED_FRAME_WIDTH 200
+// the camera is asked for the slowest frame rate at least this fast
+#define DESIRED_FRAME_RATE 30
+// how much of each new accelerometer sample goes into the smoothed gravity, which
+// takes out most of the jolting from walking
+#define GRAVITY_SMOOTHING 0.05f
+
+// a depth frame handed to the sampling code. This is the same whether it came
+// from the camera or from a recording, so the pipeline can't tell the difference.
+struct depth_frame_data
+{
+  // Z16 depth in the camera's native units - multiply by depth_scale for meters.
+  // this usually points straight into librealsense or mmap'd memory, so treat it
+  // as read-only
+  cv::Mat depth;
+  float depth_scale;
+  double timestamp_ms;
+  unsigned long long frame_number;
+  // only filled by the live source, and only when visualisation is turned on
+  cv::Mat color;
+  // the accelerometer's reading in m/s^2, in the depth camera's coordinates and
+  // smoothed over the last few samples. All zeros if there's no accelerometer
+  float gravity[3] = {0, 0, 0};
+  // keeps whatever memory depth points at alive (the librealsense frameset or
+  // the file mapping) for as long as this frame is in use
+  std::shared_ptr<void> owner;
+};
+
+// Hands the newest value from one producer thread to one consumer thread without
+// either of them ever waiting on the other. This is a triple buffer: the producer
+// fills its back slot and swaps it with the ready slot, and the consumer swaps the
+// ready slot with its front slot when it wants the newest value. Anything the
+// consumer didn't get to in time is simply replaced.
+template<typename T>
+class latest_value_slot
+{
+  static const uint8_t FRESH = 0x4;
+  static const uint8_t INDEX = 0x3;
+
+  T slots[3];
+  // the index of the ready slot, plus FRESH if it hasn't been taken yet
+  std::atomic<uint8_t> ready;
+  uint8_t back;  // only touched by the producer
+  uint8_t front; // only touched by the consumer
+
+public:
+  latest_value_slot() : ready(0), back(1), front(2) {}
+
+  // returns true if this replaced a value the consumer never took
+  bool publish(const T &value)
+  {
+    slots[back] = value;
+    uint8_t previous = ready.exchange(back | FRESH, std::memory_order_acq_rel);
+    back = previous & INDEX;
+
+    if (previous & FRESH) {
+      // let go of the dropped value now rather than when the slot is next reused
+      slots[back] = T();
+      return true;
+    }
+    return false;
+  }
+
+  bool has_fresh()
+  {
+    return ready.load(std::memory_order_acquire) & FRESH;
+  }
+
+  // takes the newest value, or returns false if there's nothing new since last time
+  bool take(T &value)
+  {
+    if (!has_fresh()) return false;
+
+    uint8_t previous = ready.exchange(front, std::memory_order_acq_rel);
+    front = previous & INDEX;
+    value = slots[front];
+    slots[front] = T();
+    return true;
+  }
+};
+
+class frame_source
+{
+  // the observer can be changed while the camera's thread is calling it, so it's
+  // only touched with observer_mutex held
+  std::mutex observer_mutex;
+  std::function<void(const depth_frame_data &)> frame_observer;
+  std::atomic<bool> observed;
+
+protected:
+  // implemented by each backend. Hands out the newest frame that hasn't already been
+  // handed out, waiting for one if need be. Returns false if there isn't one
+  virtual bool read_latest_frame(depth_frame_data &frame) = 0;
+
+  // for skipping the work of building a frame for the observer when there isn't one
+  bool has_observer()
+  {
+    return observed;
+  }
+
+  void notify_observer(const depth_frame_data &frame)
+  {
+    std::lock_guard<std::mutex> lock(observer_mutex);
+    if (frame_observer) frame_observer(frame);
+  }
+
+public:
+  // sets what's called with every frame the source produces, e.g. to record it. For
+  // the camera this is called from librealsense's thread, and includes frames that
+  // are dropped. Once this returns, the previous observer isn't being called and
+  // won't be again
+  void set_frame_observer(std::function<void(const depth_frame_data &)> observer)
+  {
+    std::lock_guard<std::mutex> lock(observer_mutex);
+    frame_observer = observer;
+    observed = (bool)frame_observer;
+  }
+
+  // frames produced, and frames that were replaced by a newer one before being picked up
+  std::atomic<unsigned long> frames_received;
+  std::atomic<unsigned long> frames_dropped;
+  // how long the last frame handed out had been waiting for us
+  float last_frame_age_ms;
+
+  frame_source() : observed(false), frames_received(0), frames_dropped(0), last_frame_age_ms(0) {}
+  virtual ~frame_source() {}
+
+  // (re)starts delivering frames. This is called again when waking from low power mode
+  virtual void start() = 0;
+  virtual void stop() = 0;
+
+  // gets the newest frame, blocking until there is one we haven't seen yet.
+  // Returns false if the source has run out of frames, or the camera has stalled
+  bool wait_for_frame(depth_frame_data &frame)
+  {
+    return read_latest_frame(frame);
+  }
+
+  virtual rs2_intrinsics get_intrinsics() = 0;
+  virtual float get_depth_scale() = 0;
+  // identifies the camera, or is empty if the frames aren't coming from one
+  virtual std::string get_serial() { return std::string(); }
+};
+
+// set from the command line - if replay_path is set, frames come from a recording
+// rather than the camera
+enum replay_rate_mode
+{
+  REPLAY_RATE_RECORDED, // at the rate the frames were captured
+  REPLAY_RATE_FIXED,    // at replay_fixed_fps
+  REPLAY_RATE_FAST      // as fast as the pipeline can take them
+};
+
+const char *replay_path = NULL;
+replay_rate_mode replay_rate = REPLAY_RATE_RECORDED;
+float replay_fixed_fps = REPLAY_DEFAULT_FPS;
+// when false, wait_for_frame returns false at the end of the recording instead
+// of starting again from the first frame
+bool replay_loop = true;
+
+// accepts "recorded", "fast" or a frame rate in frames per second
+void parse_replay_rate(const char *arg)
+{
+  if (strcmp(arg, "recorded") == 0) {
+    replay_rate = REPLAY_RATE_RECORDED;
+  } else if (strcmp(arg, "fast") == 0) {
+    replay_rate = REPLAY_RATE_FAST;
+  } else {
+    replay_rate = REPLAY_RATE_FIXED;
+    replay_fixed_fps = atof(arg);
+    if (replay_fixed_fps <= 0) {
+      throw std::runtime_error(std::string("Invalid replay rate: ") + arg);
+    }
+  }
+}
+
+// wait_for_frames gave up after 15 seconds, and so do we
+#define CAMERA_FRAME_TIMEOUT_MS 15000
+
+// the live D435i source. Frames are delivered on librealsense's own thread and only
+// the newest is kept, so the pipeline always works on the most recent view rather
+// than working through a queue of stale frames.
+class realsense_frame_source : public frame_source
+{
+  typedef std::chrono::steady_clock arrival_clock;
+
+  struct arriving_frameset
+  {
+    rs2::frameset frames;
+    arrival_clock::time_point arrival;
+  };
+
+  rs2::pipeline pipe;
+  rs2_intrinsics intrinsics;
+  // queried once when the pipeline starts rather than on every frame
+  float depth_scale;
+  std::string serial;
+
+  // the streams we asked for, worked out the first time the camera is started
+  rs2::config config;
+  bool config_negotiated = false;
+
+  latest_value_slot<arriving_frameset> latest;
+
+  // the accelerometer is a separate stream, which may be delivered on its own thread
+  bool has_accelerometer = false;
+  std::mutex gravity_mutex;
+  float gravity[3] = {0, 0, 0};
+  // only used to wake up wait_for_frame - the frames themselves never wait on this
+  std::mutex arrival_mutex;
+  std::condition_variable arrival_cv;
+
+  void to_frame_data(const rs2::frameset &frames, depth_frame_data &frame)
+  {
+    rs2::depth_frame depth = frames.get_depth_frame();
+
+    frame.depth = frame_to_mat(depth);
+    frame.depth_scale = depth_scale;
+    frame.timestamp_ms = depth.get_timestamp();
+    frame.frame_number = depth.get_frame_number();
+    frame.color = use_visualisation ? frame_to_mat(frames.get_color_frame()) : cv::Mat();
+    frame.owner = std::make_shared<rs2::frameset>(frames);
+
+    std::lock_guard<std::mutex> lock(gravity_mutex);
+    memcpy(frame.gravity, gravity, sizeof(gravity));
+  }
+
+  void on_accelerometer(const rs2::motion_frame &motion)
+  {
+    rs2_vector sample = motion.get_motion_data();
+    float reading[3] = {sample.x, sample.y, sample.z};
+
+    std::lock_guard<std::mutex> lock(gravity_mutex);
+    bool first = gravity[0] == 0 && gravity[1] == 0 && gravity[2] == 0;
+    for (int i = 0; i < 3; i++) {
+      gravity[i] = first ? reading[i] : gravity[i] + GRAVITY_SMOOTHING * (reading[i] - gravity[i]);
+    }
+  }
+
+  // called by librealsense for every frameset, and every accelerometer sample
+  void on_frame(const rs2::frame &f)
+  {
+    rs2::motion_frame motion = f.as<rs2::motion_frame>();
+    if (motion && motion.get_profile().stream_type() == RS2_STREAM_ACCEL) {
+      on_accelerometer(motion);
+      return;
+    }
+
+    // a frameset can turn up without a depth frame in it, e.g. while the streams
+    // are starting, and that mustn't replace a frame we could use
+    rs2::frameset frames = f.as<rs2::frameset>();
+    if (!frames || !frames.get_depth_frame()) return;
+
+    arriving_frameset value;
+    value.frames = frames;
+    value.arrival = arrival_clock::now();
+    frames_received++;
+
+    if (has_observer()) {
+      depth_frame_data frame;
+      to_frame_data(frames, frame);
+      notify_observer(frame);
+    }
+
+    if (latest.publish(value)) frames_dropped++;
+
+    // taking the lock makes sure a waiter is either already asleep or will see the new frame
+    { std::lock_guard<std::mutex> lock(arrival_mutex); }
+    arrival_cv.notify_one();
+  }
+
+  // Asks only for the streams we use: depth at the lowest resolution that is still
+  // at least DESIRED_FRAME_WIDTH wide, the accelerometer at its slowest rate (for
+  // finding the floor), and colour only if it's going to be shown. The default
+  // configuration streams colour, depth and both IMU streams at full size, which
+  // costs USB bandwidth and librealsense CPU for frames we then throw away or decimate.
+  // The depth still isn't small enough to skip decimating (see get_decimation_amount),
+  // but it's decimated by 2 rather than 4.
+  void negotiate_config()
+  {
+    rs2::context context;
+    auto devices = context.query_devices();
+    if (devices.size() == 0) {
+      throw std::runtime_error("No RealSense camera found");
+    }
+    auto depth_sensor = devices[0].first<rs2::depth_sensor>();
+
+    rs2::video_stream_profile best;
+    long best_pixel_rate = 0;
+    for (auto profile : depth_sensor.get_stream_profiles()) {
+      if (profile.stream_type() != RS2_STREAM_DEPTH || profile.format() != RS2_FORMAT_Z16) continue;
+      auto video = profile.as<rs2::video_stream_profile>();
+      if (video.width() < DESIRED_FRAME_WIDTH || video.fps() < DESIRED_FRAME_RATE) continue;
+
+      // the fewest pixels per second, which also picks the slowest suitable frame rate
+      long pixel_rate = (long)video.width() * video.height() * video.fps();
+      if (best_pixel_rate == 0 || pixel_rate < best_pixel_rate) {
+        best = video;
+        best_pixel_rate = pixel_rate;
+      }
+    }
+
+    // the D435 has no IMU, so the floor is found assuming the camera is level
+    int accelerometer_fps = 0;
+    for (auto sensor : devices[0].query_sensors()) {
+      for (auto profile : sensor.get_stream_profiles()) {
+        if (profile.stream_type() != RS2_STREAM_ACCEL) continue;
+        if (accelerometer_fps == 0 || profile.fps() < accelerometer_fps) accelerometer_fps = profile.fps();
+      }
+    }
+    has_accelerometer = accelerometer_fps > 0;
+
+    config.disable_all_streams();
+    if (best_pixel_rate > 0) {
+      config.enable_stream(RS2_STREAM_DEPTH, best.width(), best.height(), RS2_FORMAT_Z16, best.fps());
+    } else {
+      config.enable_stream(RS2_STREAM_DEPTH, RS2_FORMAT_Z16);
+    }
+    if (has_accelerometer) {
+      config.enable_stream(RS2_STREAM_ACCEL, RS2_FORMAT_MOTION_XYZ32F, accelerometer_fps);
+    }
+    if (use_visualisation) {
+      config.enable_stream(RS2_STREAM_COLOR, RS2_FORMAT_BGR8);
+    }
+    config_negotiated = true;
+  }
+
+public:
+  void start()
+  {
+    if (!config_negotiated) negotiate_config();
+
+    rs2::pipeline_profile selection = pipe.start(config, [this](rs2::frame f) { on_frame(f); });
+
+    printw("%i profiles found\n", selection.get_streams().size());
+    refresh();
+
+    for (auto s : selection.get_streams()) {
+      if (s.is<rs2::video_stream_profile>()) {
+        auto video = s.as<rs2::video_stream_profile>();
+        printw("%s %dx%d at %dfps\n", s.stream_name().c_str(), video.width(), video.height(), s.fps());
+      } else {
+        printw("%s at %dfps\n", s.stream_name().c_str(), s.fps());
+      }
+      refresh();
+    }
+
+    intrinsics = selection.get_stream(RS2_STREAM_DEPTH)
+                     .as<rs2::video_stream_profile>()
+                     .get_intrinsics();
+    depth_scale = selection.get_device().first<rs2::depth_sensor>().get_depth_scale();
+    serial = selection.get_device().get_info(RS2_CAMERA_INFO_SERIAL_NUMBER);
+  }
+
+  void stop()
+  {
+    pipe.stop();
+  }
+
+protected:
+  bool read_latest_frame(depth_frame_data &frame)
+  {
+    {
+      std::unique_lock<std::mutex> lock(arrival_mutex);
+      if (!arrival_cv.wait_for(lock, std::chrono::milliseconds(CAMERA_FRAME_TIMEOUT_MS),
+                               [this] { return latest.has_fresh(); })) {
+        return false;
+      }
+    }
+
+    arriving_frameset value;
+    if (!latest.take(value)) return false;
+
+    auto age = arrival_clock::now() - value.arrival;
+    last_frame_age_ms = std::chrono::duration_cast<std::chrono::microseconds>(age).count() / 1e3;
+    to_frame_data(value.frames, frame);
+    return true;
+  }
+
+public:
+  rs2_intrinsics get_intrinsics()
+  {
+    return intrinsics;
+  }
+
+  float get_depth_scale()
+  {
+    return depth_scale;
+  }
+
+  std::string get_serial()
+  {
+    return serial;
+  }
+};
+
+// a read-only memory mapping of a whole file. Replay sources hand out frames
+// which point straight into this, so the frames hold a reference to it
+struct mapped_file
+{
+  const uint8_t *data;
+  size_t length;
+
+  mapped_file(const char *path)
+  {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error(std::string("Can't open recording ") + path);
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    length = st.st_size;
+
+    void *mapping = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+      throw std::runtime_error(std::string("Can't map recording ") + path);
+    }
+    madvise(mapping, length, MADV_SEQUENTIAL);
+    data = (const uint8_t *)mapping;
+  }
+
+  ~mapped_file()
+  {
+    munmap((void *)data, length);
+  }
+};
+
+// common pacing for the replay sources. Subclasses only need to say how many
+// frames there are, when each one was captured and how to load it.
+//
+// Like the camera, the replay only hands out the newest frame that is due, so a
+// pipeline that can't keep up drops frames just as it would live. Fast replays
+// hand out every frame in turn.
+class replay_frame_source : public frame_source
+{
+  typedef std::chrono::steady_clock replay_clock;
+
+  size_t next_frame;
+  // the wall clock time that corresponds to the first frame of the recording
+  replay_clock::time_point replay_start;
+
+  replay_clock::time_point get_due_time(size_t frame_index)
+  {
+    return replay_start + std::chrono::microseconds((long long)(get_due_ms(frame_index) * 1000));
+  }
+
+  // how far into the replay (in ms) the given frame should be delivered
+  double get_due_ms(size_t frame_index)
+  {
+    switch (replay_rate) {
+      case REPLAY_RATE_RECORDED:
+        return get_frame_timestamp(frame_index) - get_frame_timestamp(0);
+      case REPLAY_RATE_FIXED:
+        return frame_index * 1000.0 / replay_fixed_fps;
+      default:
+        return 0;
+    }
+  }
+
+  void reset_clock()
+  {
+    // line the clock up so that the next frame is due straight away - this stops
+    // the replay from racing to catch up after being stopped in low power mode
+    auto due = std::chrono::microseconds((long long)(get_due_ms(next_frame) * 1000));
+    replay_start = replay_clock::now() - due;
+  }
+
+protected:
+  rs2_intrinsics intrinsics;
+  float depth_scale;
+
+  replay_frame_source() : next_frame(0), depth_scale(DEFAULT_DEPTH_SCALE) {}
+
+  virtual size_t get_frame_count() = 0;
+  virtual double get_frame_timestamp(size_t frame_index) = 0;
+  virtual void load_frame(size_t frame_index, depth_frame_data &frame) = 0;
+
+public:
+  void start()
+  {
+    reset_clock();
+  }
+
+  void stop()
+  {
+  }
+
+  rs2_intrinsics get_intrinsics()
+  {
+    return intrinsics;
+  }
+
+  float get_depth_scale()
+  {
+    return depth_scale;
+  }
+
+protected:
+  bool read_latest_frame(depth_frame_data &frame)
+  {
+    size_t frame_count = get_frame_count();
+
+    if (next_frame >= frame_count) {
+      if (!replay_loop || frame_count == 0) return false;
+      next_frame = 0;
+      reset_clock();
+    }
+
+    auto now = replay_clock::now();
+    if (replay_rate != REPLAY_RATE_FAST) {
+      // skip over any frames the camera would already have replaced with a newer one
+      while (next_frame + 1 < frame_count && get_due_time(next_frame + 1) <= now) {
+        next_frame++;
+        frames_received++;
+        frames_dropped++;
+      }
+
+      if (get_due_time(next_frame) > now) {
+        std::this_thread::sleep_until(get_due_time(next_frame));
+        now = replay_clock::now();
+      }
+    }
+
+    auto age = now - get_due_time(next_frame);
+    last_frame_age_ms = std::chrono::duration_cast<std::chrono::microseconds>(age).count() / 1e3;
+
+    load_frame(next_frame, frame);
+    frame.depth_scale = depth_scale;
+    frames_received++;
+    next_frame++;
+    notify_observer(frame);
+    return true;
+  }
+};
+
+// replays the Z16 .raw dumps written by the RealSense viewer (see r-tests). The
+// intrinsics come from the _metadata.csv written alongside, and the .raw may hold
+// any number of frames back to back.
+class raw_replay_frame_source : public replay_frame_source
+{
+  std::shared_ptr<mapped_file> mapping;
+  size_t frame_bytes;
+  size_t frame_count;
+  double first_timestamp_ms;
+  unsigned long long first_frame_number;
+
+  // reads the "key,value" lines of the viewer's metadata file
+  void read_metadata(const std::string &path)
+  {
+    std::ifstream file(path.c_str());
+    if (!file) {
+      throw std::runtime_error("Can't open replay metadata " + path);
+    }
+
+    int bytes_per_pixel = 2;
+    std::string line;
+    while (std::getline(file, line)) {
+      size_t comma = line.find(',');
+      if (comma == std::string::npos) continue;
+      std::string key = line.substr(0, comma);
+      std::string value = line.substr(comma + 1);
+      double number = atof(value.c_str());
+
+      if (key == "Resolution x") intrinsics.width = number;
+      else if (key == "Resolution y") intrinsics.height = number;
+      else if (key == "Bytes per pixel") bytes_per_pixel = number;
+      else if (key == "Fx") intrinsics.fx = number;
+      else if (key == "Fy") intrinsics.fy = number;
+      else if (key == "PPx") intrinsics.ppx = number;
+      else if (key == "PPy") intrinsics.ppy = number;
+      else if (key == "Timestamp (ms)") first_timestamp_ms = number;
+      else if (key == "Frame Number") first_frame_number = number;
+      // newer viewer versions write the depth units - older ones leave it at the default
+      else if (key == "Depth Units") depth_scale = number;
+      else if (key == "Format" && value.compare(0, 3, "Z16") != 0) {
+        throw std::runtime_error("Replay only supports Z16 depth, found " + value);
+      }
+    }
+
+    if (bytes_per_pixel != 2 || intrinsics.width <= 0 || intrinsics.height <= 0) {
+      throw std::runtime_error("Replay metadata is missing the Z16 resolution: " + path);
+    }
+  }
+
+public:
+  raw_replay_frame_source(const char *path) : first_timestamp_ms(0), first_frame_number(0)
+  {
+    // the viewer saves hallway1_Depth.raw alongside hallway1_Depth_metadata.csv
+    std::string raw_path(path);
+    size_t extension = raw_path.rfind(".raw");
+    std::string metadata_path = raw_path.substr(0, extension) + "_metadata.csv";
+
+    intrinsics = rs2_intrinsics();
+    // the viewer's Brown Conrady coefficients aren't written out, and are zero on the D435i
+    intrinsics.model = RS2_DISTORTION_BROWN_CONRADY;
+    read_metadata(metadata_path);
+
+    mapping = std::make_shared<mapped_file>(path);
+    frame_bytes = intrinsics.width * intrinsics.height * sizeof(uint16_t);
+    frame_count = mapping->length / frame_bytes;
+  }
+
+protected:
+  size_t get_frame_count()
+  {
+    return frame_count;
+  }
+
+  double get_frame_timestamp(size_t frame_index)
+  {
+    return first_timestamp_ms + frame_index * 1000.0 / REPLAY_DEFAULT_FPS;
+  }
+
+  void load_frame(size_t frame_index, depth_frame_data &frame)
+  {
+    void *data = (void *)(mapping->data + frame_index * frame_bytes);
+    frame.depth = cv::Mat(intrinsics.height, intrinsics.width, CV_16UC1, data);
+    frame.timestamp_ms = get_frame_timestamp(frame_index);
+    frame.frame_number = first_frame_number + frame_index;
+    frame.color = cv::Mat();
+    frame.owner = mapping;
+    // the viewer's dumps don't include the IMU
+    memset(frame.gravity, 0, sizeof(frame.gravity));
+  }
+};
@@ -0,0 +1,221 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <random>
+#include <math.h>
+#include <string.h>
+
+#include "simd-helpers.cpp"
+#include "rays.cpp"
+
+// Finds the floor in front of the camera, so that it isn't taken for an obstacle
+// when the camera looks down at it or up a ramp.
+//
+// The accelerometer says which way is up, so the floor is a plane facing roughly
+// that way somewhere below the camera. Points from a coarse grid over the frame are
+// deprojected through the ray tables, and a small RANSAC picks the plane through
+// three of them that the most others lie on, only trying planes within
+// GROUND_TILT_LIMIT of level. Every pixel near that plane is then marked as floor,
+// 8 at a time.
+
+// how far from level the floor may be, in degrees, which also lets ramps through
+#define GROUND_TILT_LIMIT 15
+// how far from the plane a point can be and still be on the floor, in meters
+#define GROUND_TOLERANCE 0.06f
+// the floor has to be at least this far below the camera, in meters, so that a
+// table top the camera is looking across isn't taken for it
+#define GROUND_MIN_DROP 0.5f
+// further away than this, depth is too noisy to fit the plane to
+#define GROUND_MAX_DEPTH_MM 4000
+// the plane is fitted to every GROUND_SAMPLE_STEP'th pixel of every GROUND_SAMPLE_STEP'th row
+#define GROUND_SAMPLE_STEP 4
+#define GROUND_RANSAC_ITERATIONS 32
+// a plane needs at least this many of the sampled points on it to be the floor
+#define GROUND_MIN_INLIERS 40
+
+class ground_plane
+{
+  struct point
+  {
+    float x, y, z;
+  };
+
+  // the sampled points which are far enough below the camera to be on the floor
+  std::vector<point> samples;
+  // seeded the same every run, so a replay always finds the same floor
+  std::minstd_rand random;
+
+  static float dot(const float n[3], const point &p)
+  {
+    return n[0]*p.x + n[1]*p.y + n[2]*p.z;
+  }
+
+  int count_inliers(const float n[3], float d)
+  {
+    int count = 0;
+    for (size_t i = 0; i < samples.size(); i++) {
+      count += fabsf(dot(n, samples[i]) + d) < GROUND_TOLERANCE;
+    }
+    return count;
+  }
+
+  // the plane through three points, facing up. Returns false if the points are in
+  // a line or the plane is too steep to be the floor
+  static bool plane_through(const point &a, const point &b, const point &c, const float up[3],
+    float n[3], float &d)
+  {
+    float u[3] = {b.x - a.x, b.y - a.y, b.z - a.z};
+    float v[3] = {c.x - a.x, c.y - a.y, c.z - a.z};
+    n[0] = u[1]*v[2] - u[2]*v[1];
+    n[1] = u[2]*v[0] - u[0]*v[2];
+    n[2] = u[0]*v[1] - u[1]*v[0];
+
+    float length = sqrtf(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+    if (length < 1e-9f) return false;
+    if (n[0]*up[0] + n[1]*up[1] + n[2]*up[2] < 0) length = -length;
+    for (int i = 0; i < 3; i++) n[i] /= length;
+
+    if (n[0]*up[0] + n[1]*up[1] + n[2]*up[2] < cosf(GROUND_TILT_LIMIT * 0.01745329f)) return false;
+    d = -dot(n, a);
+    return true;
+  }
+
+public:
+  bool found = false;
+  // the floor is where normal . p + offset = 0, with normal a unit vector pointing
+  // up, so offset is how high the camera is above it in meters
+  float normal[3];
+  float offset;
+  // how many of the sampled points were on it
+  int inliers = 0;
+
+  ground_plane() : random(1) {}
+
+  // looks for the floor in distances (in millimetres), which covers the frame from
+  // origin onwards. gravity is the accelerometer's reading in the depth camera's
+  // coordinates - when there isn't one (all zeros), the camera is assumed to be level
+  bool estimate(const cv::Mat &distances, cv::Point origin, const float gravity[3])
+  {
+    if (origin.x + distances.cols > rays.width || origin.y + distances.rows > rays.height) {
+      found = false;
+      return false;
+    }
+
+    // at rest the accelerometer reads the push holding it up against gravity. The
+    // camera's y points down, so level is (0, -1, 0)
+    float up[3] = {0, -1, 0};
+    float g = sqrtf(gravity[0]*gravity[0] + gravity[1]*gravity[1] + gravity[2]*gravity[2]);
+    if (g > 0) {
+      for (int i = 0; i < 3; i++) up[i] = gravity[i] / g;
+    }
+
+    samples.clear();
+    for (int row = GROUND_SAMPLE_STEP / 2; row < distances.rows; row += GROUND_SAMPLE_STEP) {
+      const uint16_t *in = distances.ptr<uint16_t>(row);
+      for (int col = GROUND_SAMPLE_STEP / 2; col < distances.cols; col += GROUND_SAMPLE_STEP) {
+        if (in[col] == 0 || in[col] > GROUND_MAX_DEPTH_MM) continue;
+
+        float p[3];
+        rays.deproject(origin.y + row, origin.x + col, in[col], p);
+        point sample = {p[0], p[1], p[2]};
+        if (dot(up, sample) > -GROUND_MIN_DROP) continue;
+        samples.push_back(sample);
+      }
+    }
+
+    float best_normal[3];
+    float best_offset = 0;
+    int best_inliers = 0;
+
+    // the floor barely moves between frames, so the last one is tried first
+    if (found && normal[0]*up[0] + normal[1]*up[1] + normal[2]*up[2] >= cosf(GROUND_TILT_LIMIT * 0.01745329f)) {
+      best_inliers = count_inliers(normal, offset);
+      memcpy(best_normal, normal, sizeof(normal));
+      best_offset = offset;
+    }
+
+    if (samples.size() >= 3) {
+      std::uniform_int_distribution<size_t> pick(0, samples.size() - 1);
+      for (int i = 0; i < GROUND_RANSAC_ITERATIONS; i++) {
+        float n[3], d;
+        if (!plane_through(samples[pick(random)], samples[pick(random)], samples[pick(random)], up, n, d)) continue;
+
+        int count = count_inliers(n, d);
+        if (count > best_inliers) {
+          best_inliers = count;
+          memcpy(best_normal, n, sizeof(n));
+          best_offset = d;
+        }
+      }
+    }
+
+    inliers = best_inliers;
+    found = best_inliers >= GROUND_MIN_INLIERS;
+    if (!found) return false;
+
+    // settle the height on the average of the points on the floor, rather than the
+    // three the plane happened to be drawn through
+    double heights = 0;
+    for (size_t i = 0; i < samples.size(); i++) {
+      float height = dot(best_normal, samples[i]) + best_offset;
+      if (fabsf(height) < GROUND_TOLERANCE) heights += height;
+    }
+    memcpy(normal, best_normal, sizeof(normal));
+    offset = best_offset - heights / best_inliers;
+    return true;
+  }
+
+  // sets floor (CV_8UC1) to 255 for the pixels of distances on the floor, and 0
+  // everywhere else. estimate has to have been called with the same frame
+  void mask_floor(const cv::Mat &distances, cv::Point origin, cv::Mat &floor)
+  {
+    floor.create(distances.size(), CV_8UC1);
+
+    if (!found) {
+      for (int row = 0; row < distances.rows; row++) {
+        memset(floor.ptr<uint8_t>(row), 0, distances.cols);
+      }
+      return;
+    }
+
+    // a pixel at depth millimetres is
+    // depth * (x_weight * x_per_meter + y_weight * y_per_meter + z_weight) + offset
+    // meters above the floor
+    float x_weight = normal[0] * 0.001f;
+    float y_weight = normal[1] * 0.001f;
+    float z_weight = normal[2] * 0.001f;
+
+    for (int row = 0; row < distances.rows; row++) {
+      const uint16_t *in = distances.ptr<uint16_t>(row);
+      uint8_t *out = floor.ptr<uint8_t>(row);
+      int first = (origin.y + row) * rays.width + origin.x;
+      const float *xs = &rays.x_per_meter[first];
+      const float *ys = &rays.y_per_meter[first];
+      int col = 0;
+
+#if THESIS_SIMD
+      f32x4 xw = f32x4_set1(x_weight), yw = f32x4_set1(y_weight), zw = f32x4_set1(z_weight);
+      f32x4 height_offset = f32x4_set1(offset);
+      f32x4 tolerance = f32x4_set1(GROUND_TOLERANCE);
+
+      for (; col + U16X8_LANES <= distances.cols; col += U16X8_LANES) {
+        u16x8 depth = u16x8_load(in + col);
+        f32x4 low = f32x4_add(f32x4_add(f32x4_mul(xw, f32x4_load(xs + col)), f32x4_mul(yw, f32x4_load(ys + col))), zw);
+        f32x4 high = f32x4_add(f32x4_add(f32x4_mul(xw, f32x4_load(xs + col + F32X4_LANES)),
+                                         f32x4_mul(yw, f32x4_load(ys + col + F32X4_LANES))), zw);
+        low = f32x4_abs(f32x4_add(f32x4_mul(u16x8_low_f32(depth), low), height_offset));
+        high = f32x4_abs(f32x4_add(f32x4_mul(u16x8_high_f32(depth), high), height_offset));
+
+        // the comparison sets all 16 bits of a lane, and only the low 8 are kept
+        u16x8_store_u8(out + col, u16x8_shr<8>(f32x4_lt_u16x8(low, high, tolerance)));
+      }
+#endif
+
+      for (; col < distances.cols; col++) {
+        float height = in[col] * (x_weight * xs[col] + y_weight * ys[col] + z_weight) + offset;
+        out[col] = fabsf(height) < GROUND_TOLERANCE ? 255 : 0;
+      }
+    }
+  }
+};
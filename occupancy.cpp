@@ -0,0 +1,193 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+#include "simd-helpers.cpp"
+
+// Integral images of how many pixels are nearer than the near and the mid
+// thresholds, so that the number of near or mid pixels in any rectangle can be
+// read off from its 4 corners, however big it is. Both are built in one pass down
+// the frame: each row's running count is a vector prefix sum (the same trick as in
+// the depth codec), which is then added to the row above.
+//
+// The frame is split into strips of rows which are built in parallel, each as if
+// it were at the top of the frame, and then each strip has the totals of the
+// strips above it added on.
+//
+// Pixels with no depth (0) are never counted, as they're where the camera couldn't
+// see anything rather than something touching it: on the D4xx there's always a band
+// of them down the left of the frame. Other pixels can be left out of the counts
+// with a mask, e.g. the ones on the floor.
+#define OCCUPANCY_STRIPS 4
+
+class occupancy_map
+{
+  // the running counts along a row, for each strip
+  std::vector<uint16_t> near_rows, mid_rows;
+  // where each strip starts
+  int strip_starts[OCCUPANCY_STRIPS + 1];
+
+  // the number of pixels counted in rect, from an integral image
+  static int count(const cv::Mat &sums, cv::Rect rect)
+  {
+    int x0 = rect.x, y0 = rect.y;
+    int x1 = rect.x + rect.width, y1 = rect.y + rect.height;
+    return sums.at<int32_t>(y1, x1) - sums.at<int32_t>(y0, x1)
+      - sums.at<int32_t>(y1, x0) + sums.at<int32_t>(y0, x0);
+  }
+
+  // counts rows [start, end) of the frame, into rows start + 1 to end of the
+  // integral images. The row before start is taken to be all zeros
+  void build_strip(const cv::Mat &distances, const cv::Mat &ignore, int start, int end,
+    uint16_t near_mm, uint16_t mid_mm, uint16_t *near_row, uint16_t *mid_row)
+  {
+    int cols = distances.cols;
+
+    for (int row = start; row < end; row++) {
+      const uint16_t *in = distances.ptr<uint16_t>(row);
+      const uint8_t *ignored = ignore.empty() ? NULL : ignore.ptr<uint8_t>(row);
+      int col = 0;
+      uint16_t near_count = 0;
+      uint16_t mid_count = 0;
+
+#if THESIS_SIMD
+      // a pixel is nearer than the threshold where threshold - 2 >= depth - 1, which
+      // also leaves out a depth of 0, as that wraps round to 65535
+      u16x8 near_limit = u16x8_set1(near_mm - 2);
+      u16x8 mid_limit = u16x8_set1(mid_mm - 2);
+      u16x8 one = u16x8_set1(1);
+      u16x8 near_carry = u16x8_zero();
+      u16x8 mid_carry = u16x8_zero();
+
+      for (; col + U16X8_LANES <= cols; col += U16X8_LANES) {
+        u16x8 depth = u16x8_sub(u16x8_load(in + col), one);
+        u16x8 near = u16x8_and(u16x8_ge(near_limit, depth), one);
+        u16x8 mid = u16x8_and(u16x8_ge(mid_limit, depth), one);
+        if (ignored != NULL) {
+          u16x8 counted = u16x8_eq_zero(u16x8_load_u8(ignored + col));
+          near = u16x8_and(near, counted);
+          mid = u16x8_and(mid, counted);
+        }
+
+        near = u16x8_add(near, u16x8_shift_up<1>(near));
+        mid = u16x8_add(mid, u16x8_shift_up<1>(mid));
+        near = u16x8_add(near, u16x8_shift_up<2>(near));
+        mid = u16x8_add(mid, u16x8_shift_up<2>(mid));
+        near = u16x8_add(near, u16x8_shift_up<4>(near));
+        mid = u16x8_add(mid, u16x8_shift_up<4>(mid));
+        near = u16x8_add(near, near_carry);
+        mid = u16x8_add(mid, mid_carry);
+        near_carry = u16x8_broadcast_last(near);
+        mid_carry = u16x8_broadcast_last(mid);
+
+        u16x8_store(near_row + col, near);
+        u16x8_store(mid_row + col, mid);
+      }
+      if (col > 0) {
+        near_count = near_row[col - 1];
+        mid_count = mid_row[col - 1];
+      }
+#endif
+
+      for (; col < cols; col++) {
+        bool counted = in[col] != 0 && (ignored == NULL || ignored[col] == 0);
+        near_count += counted && in[col] < near_mm;
+        mid_count += counted && in[col] < mid_mm;
+        near_row[col] = near_count;
+        mid_row[col] = mid_count;
+      }
+
+      int32_t *near_out = near_sums.ptr<int32_t>(row + 1);
+      int32_t *mid_out = mid_sums.ptr<int32_t>(row + 1);
+      near_out[0] = 0;
+      mid_out[0] = 0;
+      if (row == start) {
+        for (col = 0; col < cols; col++) {
+          near_out[col + 1] = near_row[col];
+          mid_out[col + 1] = mid_row[col];
+        }
+      } else {
+        const int32_t *near_above = near_sums.ptr<int32_t>(row);
+        const int32_t *mid_above = mid_sums.ptr<int32_t>(row);
+        for (col = 0; col < cols; col++) {
+          near_out[col + 1] = near_above[col + 1] + near_row[col];
+          mid_out[col + 1] = mid_above[col + 1] + mid_row[col];
+        }
+      }
+    }
+  }
+
+public:
+  // CV_32S, one row and column bigger than the frame, where each entry is the count
+  // for everything above and to the left of it
+  cv::Mat near_sums;
+  cv::Mat mid_sums;
+
+  // counts the pixels of distances (in millimetres) nearer than each threshold,
+  // leaving out any with no depth, and any which are set in ignore (CV_8UC1, the
+  // same size) if it's given
+  void build(const cv::Mat &distances, uint16_t near_mm, uint16_t mid_mm, const cv::Mat &ignore = cv::Mat())
+  {
+    assert(distances.type() == CV_16UC1);
+    assert(ignore.empty() || ignore.size() == distances.size());
+    // a row's counts have to fit in 16 bits
+    assert(distances.cols < 65536);
+    assert(near_mm > 1 && mid_mm > 1);
+
+    int rows = distances.rows;
+    int cols = distances.cols;
+    near_sums.create(rows + 1, cols + 1, CV_32S);
+    mid_sums.create(rows + 1, cols + 1, CV_32S);
+    near_rows.resize(OCCUPANCY_STRIPS * cols);
+    mid_rows.resize(OCCUPANCY_STRIPS * cols);
+
+    memset(near_sums.ptr<int32_t>(0), 0, (cols + 1) * sizeof(int32_t));
+    memset(mid_sums.ptr<int32_t>(0), 0, (cols + 1) * sizeof(int32_t));
+
+    for (int strip = 0; strip <= OCCUPANCY_STRIPS; strip++) {
+      strip_starts[strip] = rows * strip / OCCUPANCY_STRIPS;
+    }
+
+    cv::parallel_for_(cv::Range(0, OCCUPANCY_STRIPS), [&](const cv::Range &strips) {
+      for (int strip = strips.start; strip < strips.end; strip++) {
+        build_strip(distances, ignore, strip_starts[strip], strip_starts[strip + 1], near_mm, mid_mm,
+          &near_rows[strip * cols], &mid_rows[strip * cols]);
+      }
+    });
+
+    // add the bottom row of everything above to each strip after the first. This
+    // goes strip by strip, since each strip's bottom row needs the one above's
+    for (int strip = 1; strip < OCCUPANCY_STRIPS; strip++) {
+      int start = strip_starts[strip];
+      int end = strip_starts[strip + 1];
+      if (start == end) continue;
+
+      const int32_t *near_above = near_sums.ptr<int32_t>(start);
+      const int32_t *mid_above = mid_sums.ptr<int32_t>(start);
+
+      cv::parallel_for_(cv::Range(start, end), [&](const cv::Range &range) {
+        for (int row = range.start; row < range.end; row++) {
+          int32_t *near_out = near_sums.ptr<int32_t>(row + 1);
+          int32_t *mid_out = mid_sums.ptr<int32_t>(row + 1);
+          for (int col = 1; col <= cols; col++) {
+            near_out[col] += near_above[col];
+            mid_out[col] += mid_above[col];
+          }
+        }
+      });
+    }
+  }
+
+  // how many pixels in rect (which has to be inside the frame) are near
+  int count_near(cv::Rect rect) const
+  {
+    return count(near_sums, rect);
+  }
+
+  // and how many are near or mid
+  int count_mid(cv::Rect rect) const
+  {
+    return count(mid_sums, rect);
+  }
+};
@@ -0,0 +1,215 @@
+#pragma once
+
+#include <thread>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#include "queues.cpp"
+
+// Runs the three stages of processing a frame on three cores at once, so a frame
+// can be captured while the one before is segmented and the one before that is
+// classified. The first two stages get threads of their own, and the last runs on
+// whichever thread calls finish_next - the sampling thread, which is then still the
+// only one queueing sounds for the audio thread.
+//
+// The stages are joined by drop_oldest_queues, so if a later stage falls behind
+// it skips to the newest frames rather than working through a backlog of stale ones.
+
+// how many frames can wait between two stages
+#define PIPELINE_QUEUE_DEPTH 2
+#define PIPELINE_STAGES 3
+
+// how much work a stage has done since the pipeline was started. Only written by
+// the stage's own thread
+struct stage_stats
+{
+  std::atomic<unsigned long> frames;
+  std::atomic<double> busy_ms;
+
+  stage_stats() : frames(0), busy_ms(0) {}
+
+  void add(std::chrono::steady_clock::time_point started)
+  {
+    auto duration = std::chrono::steady_clock::now() - started;
+    busy_ms = busy_ms + std::chrono::duration_cast<std::chrono::microseconds>(duration).count() / 1e3;
+    frames++;
+  }
+};
+
+template<typename T>
+class staged_pipeline
+{
+public:
+  // fills in the next frame, returning false when there aren't any more
+  typedef std::function<bool(T &)> first_stage;
+  // works on a frame from the first stage, writing what the last stage needs to out
+  typedef std::function<void(const T &, T &)> middle_stage;
+  typedef std::function<void(const T &)> last_stage;
+
+private:
+  first_stage first;
+  middle_stage middle;
+  last_stage last;
+
+  drop_oldest_queue<T, PIPELINE_QUEUE_DEPTH> first_to_middle;
+  drop_oldest_queue<T, PIPELINE_QUEUE_DEPTH> middle_to_last;
+  std::thread first_thread;
+  std::thread middle_thread;
+  std::atomic<bool> running;
+  std::chrono::steady_clock::time_point started;
+  std::chrono::steady_clock::time_point first_stage_start;
+
+  // for holding the first stage back until the last has caught up with it
+  std::mutex finished_mutex;
+  std::condition_variable finished_changed;
+  unsigned long frames_started = 0;  // only touched by the first stage
+  unsigned long frames_finished = 0;
+
+  void run_first()
+  {
+    if (on_thread_start) on_thread_start(0);
+    while (running) {
+      first_stage_start = std::chrono::steady_clock::now();
+      if (!first(first_to_middle.back())) break;
+      stats[0].add(first_stage_start);
+
+      first_to_middle.push();
+      frames_started++;
+    }
+    first_to_middle.close();
+  }
+
+  void run_middle()
+  {
+    if (on_thread_start) on_thread_start(1);
+    const T *frame;
+    while (first_to_middle.wait_take(frame)) {
+      if (!running) continue;
+
+      auto stage_start = std::chrono::steady_clock::now();
+      middle(*frame, middle_to_last.back());
+      stats[1].add(stage_start);
+
+      middle_to_last.push();
+    }
+    middle_to_last.close();
+  }
+
+  bool caught_up()
+  {
+    // frames which were dropped on the way are never going to finish
+    return frames_finished + first_to_middle.dropped + middle_to_last.dropped >= frames_started;
+  }
+
+public:
+  stage_stats stats[PIPELINE_STAGES];
+  // called at the start of the first (0) and middle (1) stages' threads, e.g. to
+  // set their priority
+  std::function<void(int)> on_thread_start;
+
+  staged_pipeline(first_stage first, middle_stage middle, last_stage last)
+    : first(first), middle(middle), last(last), running(false) {}
+
+  // whether the pipeline has been started and not stopped, even if it has since run
+  // out of frames
+  bool is_running()
+  {
+    return first_thread.joinable();
+  }
+
+  void start()
+  {
+    if (is_running()) return;
+
+    first_to_middle.reopen();
+    middle_to_last.reopen();
+    for (int i = 0; i < PIPELINE_STAGES; i++) {
+      stats[i].frames = 0;
+      stats[i].busy_ms = 0;
+    }
+    frames_started = 0;
+    frames_finished = 0;
+    started = std::chrono::steady_clock::now();
+
+    running = true;
+    first_thread = std::thread(&staged_pipeline::run_first, this);
+    middle_thread = std::thread(&staged_pipeline::run_middle, this);
+  }
+
+  // waits for the first stage to finish the frame it's on, and throws away anything
+  // still in the queues. Only call this from the thread that calls finish_next
+  void stop()
+  {
+    if (!is_running()) return;
+
+    {
+      std::lock_guard<std::mutex> lock(finished_mutex);
+      running = false;
+    }
+    finished_changed.notify_all();
+    first_thread.join();
+    middle_thread.join();
+  }
+
+  // runs the last stage on the next frame, waiting for one if need be. Returns false
+  // once the first stage has run out of frames, or the pipeline has been stopped
+  bool finish_next()
+  {
+    const T *frame;
+    if (!middle_to_last.wait_take(frame)) return false;
+
+    auto stage_start = std::chrono::steady_clock::now();
+    last(*frame);
+    stats[2].add(stage_start);
+
+    {
+      std::lock_guard<std::mutex> lock(finished_mutex);
+      frames_finished++;
+    }
+    finished_changed.notify_all();
+    return true;
+  }
+
+  // called from the first stage to hold it back until every frame it has handed on
+  // has been through the last stage, e.g. so one frame can be followed all the way
+  // through on its own. Returns false if the pipeline is being stopped instead
+  bool wait_for_last_stage()
+  {
+    std::unique_lock<std::mutex> lock(finished_mutex);
+    finished_changed.wait(lock, [&] { return !running || caught_up(); });
+    return running;
+  }
+
+  // called from the first stage with when its input arrived, so that its time
+  // doesn't include waiting for the camera
+  void first_stage_input_arrived(std::chrono::steady_clock::time_point arrived)
+  {
+    first_stage_start = arrived;
+  }
+
+  // how many frames are waiting before stage (1 or 2), at the moment and at most
+  uint32_t queue_depth(int stage)
+  {
+    return stage == 1 ? first_to_middle.depth() : middle_to_last.depth();
+  }
+
+  uint32_t max_queue_depth(int stage)
+  {
+    return stage == 1 ? first_to_middle.max_depth : middle_to_last.max_depth;
+  }
+
+  // frames dropped from the queue before stage (1 or 2) because it fell behind
+  unsigned long frames_dropped(int stage)
+  {
+    return stage == 1 ? first_to_middle.dropped : middle_to_last.dropped;
+  }
+
+  float get_running_seconds()
+  {
+    auto duration = std::chrono::steady_clock::now() - started;
+    return std::chrono::duration_cast<std::chrono::milliseconds>(duration).count() / 1e3f;
+  }
+};
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include "simd-helpers.cpp"
+#include "rays.cpp"
+
+// The nearest thing in each direction along a band of rows around the horizon,
+// like r-tests/r-tests.R plots from the middle row. The band is reduced to the
+// nearest depth in each column in one pass down its rows, 8 columns at a time, and
+// the columns are then grouped into bins covering equal angles. Each bin holds a
+// percentile of its columns' nearest depths: the nearest of them by default, or
+// something further in so that a stray column or two is ignored.
+
+#define POLAR_BINS 15
+// how far above and below the horizon the band reaches, in degrees
+#define POLAR_BAND_DEGREES 3
+
+// set from the command line with --polar-bins, --polar-band and --polar-percentile
+int polar_bin_count = POLAR_BINS;
+float polar_band_degrees = POLAR_BAND_DEGREES;
+int polar_percentile = 0;
+
+void parse_polar_bins(const char *arg)
+{
+  polar_bin_count = atoi(arg);
+  if (polar_bin_count < 1) {
+    throw std::runtime_error(std::string("Invalid number of polar bins: ") + arg);
+  }
+}
+
+void parse_polar_band(const char *arg)
+{
+  polar_band_degrees = atof(arg);
+  if (polar_band_degrees < 0) {
+    throw std::runtime_error(std::string("Invalid polar band: ") + arg);
+  }
+}
+
+void parse_polar_percentile(const char *arg)
+{
+  polar_percentile = atoi(arg);
+  if (polar_percentile < 0 || polar_percentile > 100) {
+    throw std::runtime_error(std::string("Invalid polar percentile: ") + arg);
+  }
+}
+
+class polar_histogram
+{
+  // the nearest depth in each column, less one so that holes (0) wrap around to
+  // the furthest depth and never win the minimum
+  std::vector<uint16_t> column_nearest;
+  // the first column of each bin, and then the width of the frame
+  std::vector<int> bin_starts;
+  std::vector<uint16_t> bin_depths;
+
+  // splits the columns into bins of equal angle, from the ray tables if they were
+  // built for this width and evenly across the columns otherwise
+  void assign_columns(int cols, int bin_count)
+  {
+    bin_starts.resize(bin_count + 1);
+    bin_thetas.resize(bin_count);
+    bool use_rays = rays.width == cols;
+
+    float first_theta = use_rays ? rays.azimuths[0] : 0;
+    float last_theta = use_rays ? rays.azimuths[cols - 1] : 0;
+    float bin_theta = (last_theta - first_theta) / bin_count;
+
+    int col = 0;
+    for (int bin = 0; bin < bin_count; bin++) {
+      if (use_rays) {
+        while (col < cols && rays.azimuths[col] < first_theta + bin * bin_theta) col++;
+      } else {
+        col = bin * cols / bin_count;
+      }
+      bin_starts[bin] = col;
+      bin_thetas[bin] = first_theta + (bin + 0.5f) * bin_theta;
+    }
+    bin_starts[bin_count] = cols;
+  }
+
+public:
+  // the nearest depth in millimetres in each bin, or 0 if the whole bin is holes
+  std::vector<uint16_t> bins;
+  // the direction of the middle of each bin, in degrees from straight ahead. These
+  // are only known when the ray tables match the frame
+  std::vector<float> bin_thetas;
+
+  // builds the histogram from band, which has to span the whole width of the frame
+  void build(const cv::Mat &band, int bin_count, int percentile)
+  {
+    assert(band.type() == CV_16UC1);
+    int cols = band.cols;
+    bin_count = std::max(std::min(bin_count, cols), 1);
+
+    column_nearest.assign(cols, 0xFFFF);
+    for (int row = 0; row < band.rows; row++) {
+      const uint16_t *in = band.ptr<uint16_t>(row);
+      uint16_t *nearest = &column_nearest[0];
+      int col = 0;
+
+#if THESIS_SIMD
+      u16x8 one = u16x8_set1(1);
+      for (; col + U16X8_LANES <= cols; col += U16X8_LANES) {
+        u16x8 depth = u16x8_sub(u16x8_load(in + col), one);
+        u16x8_store(nearest + col, u16x8_min(u16x8_load(nearest + col), depth));
+      }
+#endif
+
+      for (; col < cols; col++) {
+        nearest[col] = std::min(nearest[col], (uint16_t)(in[col] - 1));
+      }
+    }
+
+    assign_columns(cols, bin_count);
+    bins.resize(bin_count);
+    for (int bin = 0; bin < bin_count; bin++) {
+      bin_depths.clear();
+      for (int col = bin_starts[bin]; col < bin_starts[bin + 1]; col++) {
+        uint16_t depth = column_nearest[col] + 1;
+        if (depth != 0) bin_depths.push_back(depth);
+      }
+
+      if (bin_depths.empty()) {
+        bins[bin] = 0;
+        continue;
+      }
+      auto chosen = bin_depths.begin() + (bin_depths.size() - 1) * percentile / 100;
+      std::nth_element(bin_depths.begin(), chosen, bin_depths.end());
+      bins[bin] = *chosen;
+    }
+  }
+
+  // the bin a column of the frame falls in
+  int get_bin(int col) const
+  {
+    int bin = std::upper_bound(bin_starts.begin(), bin_starts.end(), col) - bin_starts.begin() - 1;
+    return std::min(std::max(bin, 0), (int)bins.size() - 1);
+  }
+};
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <stdint.h>
+#include <assert.h>
+
+// Queues for handing work from one thread to another without either of them
+// waiting on a lock the other holds.
+
+// A wait-free queue from one producer thread to one consumer thread. Each side
+// only writes its own index, and publishes it with release ordering after
+// writing or reading a slot, so neither ever waits on a lock the other holds.
+// One slot is always left empty to tell a full ring from an empty one.
+template<typename T, int N>
+class spsc_ring
+{
+  T slots[N];
+  // kept on separate cache lines so the two threads don't fight over them
+  alignas(64) std::atomic<unsigned> head; // the next slot to read, only written by the consumer
+  alignas(64) std::atomic<unsigned> tail; // the next slot to write, only written by the producer
+
+public:
+  spsc_ring() : head(0), tail(0) {}
+
+  // returns false if the ring is full
+  bool push(const T &value)
+  {
+    unsigned t = tail.load(std::memory_order_relaxed);
+    unsigned next = (t + 1) % N;
+    if (next == head.load(std::memory_order_acquire)) return false;
+
+    slots[t] = value;
+    tail.store(next, std::memory_order_release);
+    return true;
+  }
+
+  // returns false if the ring is empty
+  bool pop(T &value)
+  {
+    unsigned h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) return false;
+
+    value = slots[h];
+    head.store((h + 1) % N, std::memory_order_release);
+    return true;
+  }
+};
+
+// A bounded queue from one producer thread to one consumer thread which never makes
+// the producer wait: when it's full, the oldest item is dropped to make room, so
+// the consumer is never more than DEPTH items behind. Items aren't copied in or
+// out. The queue owns DEPTH + 3 of them, which are filled and read in place while
+// their indices are passed around, so anything they hold (like a cv::Mat's buffer)
+// is allocated once and then reused.
+//
+// The consumer takes the oldest item by moving head on with a compare and swap,
+// and the producer drops it the same way, so whichever of them gets there first
+// owns it. head and tail count up forever, so they can only be mistaken for an
+// older position after 2^32 items.
+template<typename T, int DEPTH>
+class drop_oldest_queue
+{
+  // one being filled, one being read plus the one it's about to replace, DEPTH
+  // queued, and one spare so the producer never runs out
+  static const int ITEM_COUNT = DEPTH + 3;
+
+  T items[ITEM_COUNT];
+  // the indices of the queued items, by position % DEPTH
+  std::atomic<uint8_t> queued[DEPTH];
+  alignas(64) std::atomic<uint32_t> head; // the oldest queued position
+  alignas(64) std::atomic<uint32_t> tail; // the next position to queue, only written by the producer
+  // items the consumer has finished with, on their way back to the producer
+  spsc_ring<uint8_t, ITEM_COUNT> released;
+  uint8_t writing; // only touched by the producer
+  uint8_t reading; // only touched by the consumer
+
+  // only used to put the consumer to sleep when the queue is empty. The producer
+  // only takes the lock when the consumer is asleep
+  std::mutex wake_mutex;
+  std::condition_variable wake;
+  std::atomic<bool> sleeping;
+  std::atomic<bool> closed;
+
+public:
+  // statistics for display
+  std::atomic<unsigned long> pushed;
+  std::atomic<unsigned long> dropped;
+  std::atomic<uint32_t> max_depth;
+
+  drop_oldest_queue() : head(0), tail(0), writing(0), reading(1), sleeping(false), closed(false),
+    pushed(0), dropped(0), max_depth(0)
+  {
+    for (int i = 2; i < ITEM_COUNT; i++) released.push(i);
+  }
+
+  // the item the producer fills before pushing it
+  T &back() { return items[writing]; }
+
+  // queues the item from back(), dropping the oldest if the queue is full
+  void push()
+  {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    uint8_t next = 0;
+    bool reuse_dropped = false;
+
+    // if the consumer takes an item while we're doing this, there's room after all
+    uint32_t h = head.load(std::memory_order_acquire);
+    while (t - h >= DEPTH) {
+      next = queued[h % DEPTH].load(std::memory_order_relaxed);
+      if (head.compare_exchange_weak(h, h + 1, std::memory_order_acq_rel, std::memory_order_acquire)) {
+        reuse_dropped = true;
+        dropped++;
+        break;
+      }
+    }
+
+    queued[t % DEPTH].store(writing, std::memory_order_relaxed);
+    // sequentially consistent, like sleeping, so either the consumer sees the new
+    // tail before it goes to sleep or we see that it's asleep
+    tail.store(t + 1);
+    pushed++;
+    uint32_t queue_depth = t + 1 - head.load(std::memory_order_relaxed);
+    if (queue_depth > max_depth) max_depth = queue_depth;
+
+    // there's always a released item when nothing was dropped, see ITEM_COUNT
+    if (!reuse_dropped) {
+      bool had_released = released.pop(next);
+      assert(had_released);
+    }
+    writing = next;
+
+    if (sleeping) {
+      std::lock_guard<std::mutex> lock(wake_mutex);
+      wake.notify_one();
+    }
+  }
+
+  // takes the oldest queued item, or returns false if the queue is empty. The item
+  // belongs to the consumer until its next take
+  bool take(const T *&item)
+  {
+    uint32_t h = head.load(std::memory_order_acquire);
+    while (h != tail.load(std::memory_order_acquire)) {
+      uint8_t index = queued[h % DEPTH].load(std::memory_order_relaxed);
+      // on failure this reloads h, as the producer dropped the item first
+      if (head.compare_exchange_weak(h, h + 1, std::memory_order_acq_rel, std::memory_order_acquire)) {
+        released.push(reading);
+        reading = index;
+        item = &items[reading];
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // like take, but sleeps until there's an item. Returns false once the queue has
+  // been closed and everything in it taken
+  bool wait_take(const T *&item)
+  {
+    while (!take(item)) {
+      std::unique_lock<std::mutex> lock(wake_mutex);
+      sleeping = true;
+      wake.wait(lock, [&] { return depth() > 0 || closed; });
+      sleeping = false;
+      if (depth() == 0 && closed) return false;
+    }
+    return true;
+  }
+
+  uint32_t depth()
+  {
+    // head first, as it can't pass the tail read after it
+    uint32_t h = head;
+    return tail - h;
+  }
+
+  // called by the producer when it has nothing more to push
+  void close()
+  {
+    std::lock_guard<std::mutex> lock(wake_mutex);
+    closed = true;
+    wake.notify_one();
+  }
+
+  // throws away anything left in a closed queue so it can be used again. Neither
+  // thread can be using it
+  void reopen()
+  {
+    const T *item;
+    while (take(item)) {}
+    closed = false;
+    pushed = 0;
+    dropped = 0;
+    max_depth = 0;
+  }
+};
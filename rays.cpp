@@ -0,0 +1,199 @@
+#pragma once
+
+#include <librealsense2/rs.hpp>
+#include <librealsense2/rsutil.h>
+#include <vector>
+#include <string>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+// Lookup tables for the direction each pixel of the processed (decimated) frame
+// looks in. Working these out means running the camera's distortion model, which
+// is far too slow to do per pixel per frame, but they only depend on the intrinsics
+// so they're built once at startup and kept on disk for each camera.
+
+#define RAY_CACHE_MAGIC "THRAYS01"
+
+#define DEGREES_PER_RADIAN 57.29578f
+
+// the whole degrees of azimuth theta_columns covers, either side of straight ahead
+#define RAY_MAX_THETA 90
+
+class ray_table
+{
+  struct cache_header
+  {
+    char magic[8];
+    rs2_intrinsics intrinsics;
+  };
+
+  rs2_intrinsics intrinsics;
+
+  // the column whose azimuth is nearest each whole degree from -RAY_MAX_THETA
+  std::vector<int> theta_columns;
+
+  bool load(const std::string &path)
+  {
+    FILE *file = fopen(path.c_str(), "rb");
+    if (file == NULL) return false;
+
+    cache_header header;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+              memcmp(header.magic, RAY_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+              memcmp(&header.intrinsics, &intrinsics, sizeof(intrinsics)) == 0;
+    if (ok) {
+      allocate();
+      size_t pixels = x.size();
+      ok = fread(&x[0], sizeof(float), pixels, file) == pixels &&
+           fread(&y[0], sizeof(float), pixels, file) == pixels &&
+           fread(&z[0], sizeof(float), pixels, file) == pixels;
+    }
+    fclose(file);
+    return ok;
+  }
+
+  void save(const std::string &path)
+  {
+    FILE *file = fopen(path.c_str(), "wb");
+    // the cache is only there to speed up startup, so it doesn't matter if it can't be written
+    if (file == NULL) return;
+
+    cache_header header;
+    memcpy(header.magic, RAY_CACHE_MAGIC, sizeof(header.magic));
+    header.intrinsics = intrinsics;
+    size_t pixels = x.size();
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(&x[0], sizeof(float), pixels, file) == pixels &&
+              fwrite(&y[0], sizeof(float), pixels, file) == pixels &&
+              fwrite(&z[0], sizeof(float), pixels, file) == pixels;
+    fclose(file);
+    if (!ok) remove(path.c_str());
+  }
+
+  void allocate()
+  {
+    size_t pixels = (size_t)width * height;
+    x.resize(pixels);
+    y.resize(pixels);
+    z.resize(pixels);
+  }
+
+  void deproject_all()
+  {
+    allocate();
+    for (int row = 0; row < height; row++) {
+      for (int col = 0; col < width; col++) {
+        float pixel[2] = {(float)col, (float)row};
+        float point[3];
+        rs2_deproject_pixel_to_point(point, &intrinsics, pixel, 1);
+
+        float length = sqrtf(point[0]*point[0] + point[1]*point[1] + point[2]*point[2]);
+        int i = row * width + col;
+        x[i] = point[0] / length;
+        y[i] = point[1] / length;
+        z[i] = point[2] / length;
+      }
+    }
+  }
+
+  // the angles are read off the middle row and column, which is where the clap
+  // pointers sample and near enough for the rest of the frame
+  void build_angles()
+  {
+    x_per_meter.resize(x.size());
+    y_per_meter.resize(y.size());
+    for (size_t i = 0; i < x.size(); i++) {
+      x_per_meter[i] = x[i] / z[i];
+      y_per_meter[i] = y[i] / z[i];
+    }
+
+    azimuths.resize(width);
+    for (int col = 0; col < width; col++) {
+      int i = (height / 2) * width + col;
+      azimuths[col] = atan2f(x[i], z[i]) * DEGREES_PER_RADIAN;
+    }
+
+    elevations.resize(height);
+    for (int row = 0; row < height; row++) {
+      int i = row * width + width / 2;
+      elevations[row] = atan2f(-y[i], z[i]) * DEGREES_PER_RADIAN;
+    }
+
+    // azimuth only ever increases across the frame, so one walk finds every column
+    theta_columns.resize(2 * RAY_MAX_THETA + 1);
+    int col = 0;
+    for (int theta = -RAY_MAX_THETA; theta <= RAY_MAX_THETA; theta++) {
+      while (col + 1 < width && fabsf(azimuths[col + 1] - theta) <= fabsf(azimuths[col] - theta)) col++;
+      theta_columns[theta + RAY_MAX_THETA] = col;
+    }
+  }
+
+public:
+  // the size of the frame the tables were built for
+  int width = 0;
+  int height = 0;
+
+  // a unit ray for every pixel in the camera's coordinates (x right, y down, z
+  // forwards), kept as one row-major array per axis so rows load straight into vectors
+  std::vector<float> x, y, z;
+  // the x and y of the point each pixel sees at a depth of 1 meter, so that a pixel
+  // at depth d sees (d * x_per_meter, d * y_per_meter, d)
+  std::vector<float> x_per_meter, y_per_meter;
+
+  // degrees from straight ahead of each column (positive to the right) and each
+  // row (positive up)
+  std::vector<float> azimuths;
+  std::vector<float> elevations;
+
+  // builds the tables for frames decimated by the given amount, reading them from
+  // a cache file for this camera if one has already been written. Recordings don't
+  // have a serial, so their tables are always built from scratch
+  void build(rs2_intrinsics camera, int decimation, const std::string &serial)
+  {
+    // each decimated pixel stands for the middle of a decimation x decimation block,
+    // so the focal lengths shrink with the frame and the optical centre moves with them
+    if (decimation > 1) {
+      float block_centre = (decimation - 1) / 2.0f;
+      camera.width /= decimation;
+      camera.height /= decimation;
+      camera.ppx = (camera.ppx - block_centre) / decimation;
+      camera.ppy = (camera.ppy - block_centre) / decimation;
+      camera.fx /= decimation;
+      camera.fy /= decimation;
+    }
+    intrinsics = camera;
+    width = camera.width;
+    height = camera.height;
+
+    std::string path;
+    if (!serial.empty()) {
+      path = "rays_" + serial + "_" + std::to_string(width) + "x" + std::to_string(height) + ".cache";
+    }
+
+    if (path.empty() || !load(path)) {
+      deproject_all();
+      if (!path.empty()) save(path);
+    }
+    build_angles();
+  }
+
+  // the column nearest to theta degrees from straight ahead
+  int get_column(float theta) const
+  {
+    int degree = (int)lrintf(theta);
+    degree = std::min(std::max(degree, -RAY_MAX_THETA), RAY_MAX_THETA);
+    return theta_columns[degree + RAY_MAX_THETA];
+  }
+
+  // the point in meters, in the camera's coordinates, seen by a pixel at depth millimetres
+  void deproject(int row, int col, uint16_t depth, float point[3]) const
+  {
+    int i = row * width + col;
+    point[2] = depth * 0.001f;
+    point[0] = x_per_meter[i] * point[2];
+    point[1] = y_per_meter[i] * point[2];
+  }
+};
+
+ray_table rays;
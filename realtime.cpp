@@ -0,0 +1,273 @@
+#pragma once
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <thread>
+#include <mutex>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+#include <opencv2/opencv.hpp>
+
+// Keeps the audio thread from being held up by everything else on the Pi. The
+// audio thread gets a real-time priority, so OpenCV work and ncurses refreshes
+// can't preempt it into an XRUN. The audio, sampling and pipeline threads are
+// each pinned to a core of their own, so they don't bounce their caches around
+// or queue up behind one another. Memory is locked, so none of them stalls on a
+// page fault in the middle of a frame or a period, and each thread's stack is
+// touched up front so it's already there to lock. OpenCV's worker threads are
+// left to run on every core but the audio thread's.
+//
+// None of this needs to be granted for the program to run. Without root (or
+// rtprio and memlock limits for the user, e.g. in /etc/security/limits.conf)
+// it's refused, and the startup report says so.
+
+#define REALTIME_AUDIO_PRIORITY 40
+// how much of each thread's stack is touched when it starts
+#define REALTIME_STACK_PREFAULT_BYTES (64 * 1024)
+
+enum thread_role
+{
+  THREAD_AUDIO,
+  THREAD_SAMPLING, // runs the classification, and the state machine around it
+  THREAD_CAPTURE,  // the pipeline's capture and filtering stage
+  THREAD_SEGMENT,  // the pipeline's segmentation stage
+  THREAD_ROLE_COUNT
+};
+
+const char *thread_role_names[THREAD_ROLE_COUNT] = {"audio", "sampling", "capture+filter", "segment"};
+
+// set from the command line with --audio-priority, --thread-cores and --no-mlock.
+// A priority of 0 leaves the audio thread with normal scheduling, and a core of
+// -1 leaves a thread unpinned
+int audio_thread_priority = REALTIME_AUDIO_PRIORITY;
+int thread_cores[THREAD_ROLE_COUNT] = {3, 0, 2, 1};
+bool use_memory_locking = true;
+
+void parse_audio_priority(const char *arg)
+{
+  audio_thread_priority = atoi(arg);
+  if (audio_thread_priority < 0 || audio_thread_priority > 99) {
+    throw std::runtime_error(std::string("Invalid audio priority: ") + arg);
+  }
+}
+
+// accepts "off", or the cores for the audio, sampling, capture and segment threads
+// separated by commas, e.g. 3,0,2,1
+void parse_thread_cores(const char *arg)
+{
+  if (strcmp(arg, "off") == 0) {
+    for (int i = 0; i < THREAD_ROLE_COUNT; i++) thread_cores[i] = -1;
+    return;
+  }
+
+  const char *next = arg;
+  for (int i = 0; i < THREAD_ROLE_COUNT; i++) {
+    char *end;
+    thread_cores[i] = strtol(next, &end, 10);
+    bool last = i == THREAD_ROLE_COUNT - 1;
+    if (end == next || thread_cores[i] < -1 || *end != (last ? '\0' : ',')) {
+      throw std::runtime_error(std::string("Invalid thread cores: ") + arg);
+    }
+    next = end + 1;
+  }
+}
+
+// touches the next REALTIME_STACK_PREFAULT_BYTES of the calling thread's stack
+void prefault_stack()
+{
+  volatile char stack[REALTIME_STACK_PREFAULT_BYTES];
+  for (int i = 0; i < REALTIME_STACK_PREFAULT_BYTES; i += 1024) stack[i] = 0;
+}
+
+class thread_policy
+{
+  // what each thread was actually given, for the report
+  struct thread_grant
+  {
+    bool configured = false;
+    int priority = 0;  // 0 for normal scheduling
+    int core = -1;     // -1 if it can run anywhere
+    std::string refused;
+  };
+
+  std::mutex mutex;
+  thread_grant grants[THREAD_ROLE_COUNT];
+  std::string memory_report = "not locked";
+  std::string workers_report = "not started";
+
+  static std::string describe_error(const char *what, int error)
+  {
+    return std::string(what) + " refused: " + strerror(error);
+  }
+
+public:
+  // applies the policy for role to thread
+  void configure(pthread_t thread, thread_role role)
+  {
+    thread_grant grant;
+    grant.configured = true;
+
+    int core = thread_cores[role];
+    if (core >= sysconf(_SC_NPROCESSORS_ONLN)) {
+      grant.refused = "core " + std::to_string(core) + " doesn't exist";
+    } else if (core >= 0) {
+      cpu_set_t cores;
+      CPU_ZERO(&cores);
+      CPU_SET(core, &cores);
+      int error = pthread_setaffinity_np(thread, sizeof(cores), &cores);
+      if (error == 0) {
+        grant.core = core;
+      } else {
+        grant.refused = describe_error("pinning", error);
+      }
+    }
+
+    if (role == THREAD_AUDIO && audio_thread_priority > 0) {
+      sched_param param;
+      memset(&param, 0, sizeof(param));
+      param.sched_priority = audio_thread_priority;
+      int error = pthread_setschedparam(thread, SCHED_FIFO, &param);
+      if (error == 0) {
+        grant.priority = audio_thread_priority;
+      } else {
+        if (!grant.refused.empty()) grant.refused += ", ";
+        grant.refused += describe_error("real-time priority", error);
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    grants[role] = grant;
+  }
+
+  void configure(std::thread &thread, thread_role role)
+  {
+    configure(thread.native_handle(), role);
+  }
+
+  // for threads which set themselves up when they start
+  void configure_this_thread(thread_role role)
+  {
+    configure(pthread_self(), role);
+    if (use_memory_locking) prefault_stack();
+  }
+
+  // OpenCV starts its worker threads the first time parallel_for_ is called, and a
+  // new thread inherits its creator's affinity. Left to the first stage thread to
+  // call it, every parallel_for_ would then be run on that thread's one core, so
+  // the pool is started here instead. Call this from the main thread before any
+  // other thread is started, and it keeps itself and the workers off the audio core
+  void start_worker_pool()
+  {
+    int cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int audio_core = thread_cores[THREAD_AUDIO];
+    std::string affinity = "any core";
+    if (audio_core >= 0 && audio_core < cores && cores > 1) {
+      cpu_set_t others;
+      CPU_ZERO(&others);
+      for (int core = 0; core < cores; core++) {
+        if (core != audio_core) CPU_SET(core, &others);
+      }
+      int error = pthread_setaffinity_np(pthread_self(), sizeof(others), &others);
+      if (error == 0) {
+        affinity = "every core but " + std::to_string(audio_core);
+      } else {
+        affinity += " (" + describe_error("keeping off the audio core", error) + ")";
+      }
+    }
+
+    // a range of one would just be run on this thread, so give every thread a part
+    int threads = cv::getNumThreads();
+    cv::parallel_for_(cv::Range(0, std::max(threads, 2)), [](const cv::Range &) {});
+    workers_report = std::to_string(threads) + " threads, " + affinity;
+  }
+
+  // locks everything mapped so far, and if the limits allow it everything mapped
+  // from now on. Pages are locked as they're first touched, rather than all at once
+  // (which for every thread's stack would be megabytes), so what's locked is what
+  // the program actually uses
+  void lock_memory()
+  {
+    if (!use_memory_locking) {
+      memory_report = "not locked (--no-mlock)";
+      return;
+    }
+
+    // MCL_FUTURE makes allocations fail once the locked memory limit is reached, so
+    // it's only asked for when there isn't a limit
+    rlimit limit;
+    getrlimit(RLIMIT_MEMLOCK, &limit);
+    bool unlimited = geteuid() == 0 || limit.rlim_cur == RLIM_INFINITY;
+    int flags = MCL_CURRENT | (unlimited ? MCL_FUTURE : 0);
+
+    int result = -1;
+#ifdef MCL_ONFAULT
+    result = mlockall(flags | MCL_ONFAULT);
+    // kernels before 4.4 don't know about MCL_ONFAULT
+    if (result != 0 && errno == EINVAL) result = mlockall(flags);
+#else
+    result = mlockall(flags);
+#endif
+
+    if (result == 0) {
+      memory_report = unlimited ? "locked, along with everything allocated from now on" : "locked as it was at startup";
+    } else {
+      memory_report = describe_error("locking", errno);
+      if (!unlimited) {
+        memory_report += " (the limit is " + std::to_string(limit.rlim_cur / 1024) + "KB)";
+      }
+    }
+  }
+
+  // prints what was actually granted
+  void print_report()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    printw("Thread policy:\n");
+    for (int role = 0; role < THREAD_ROLE_COUNT; role++) {
+      printw("%s", describe_grant((thread_role)role).c_str());
+    }
+    printw("  %-15s%s\n", "opencv workers", workers_report.c_str());
+    printw("  %-15s%s\n", "memory", memory_report.c_str());
+  }
+
+  // what the pipeline's threads were granted, which they only ask for once they've
+  // been started to watch for obstacles. This is called from the sampling thread, so
+  // it's up to the caller to get it onto the screen
+  std::string describe_pipeline_grants()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return describe_grant(THREAD_CAPTURE) + describe_grant(THREAD_SEGMENT);
+  }
+
+private:
+  std::string describe_grant(thread_role role)
+  {
+    const thread_grant &grant = grants[role];
+    char name[20];
+    snprintf(name, sizeof(name), "  %-15s", thread_role_names[role]);
+    std::string description = name;
+    if (!grant.configured) {
+      if (thread_cores[role] >= 0) {
+        description += "core " + std::to_string(thread_cores[role]);
+      } else {
+        description += "any core";
+      }
+      return description + " once started, reported with the pipeline stats\n";
+    }
+
+    description += grant.priority > 0 ? "real-time priority " + std::to_string(grant.priority) : "normal priority";
+    description += grant.core >= 0 ? ", core " + std::to_string(grant.core) : ", any core";
+    if (!grant.refused.empty()) description += " (" + grant.refused + ")";
+    return description + "\n";
+  }
+};
+
+thread_policy thread_setup;
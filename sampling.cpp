@@ -1,26 +1,18 @@
 #pragma once
 
 #include <thread>
+#include <atomic>
+
+#include "pipeline.cpp"
 
 std::thread sampling_thread;
 
-rs2::pipeline *p;
+// where depth frames come from - the camera, or a recording when replaying
+frame_source *source;
 
 float fovwidth;
 float fovheight;
 
-bool ready_for_sample = false;
-
-// whether the subsystems should go into low-power mode.
-// this is currently set by the input loop and checked
-// by the sampling loop
-bool low_power_mode = false;
-
-// tracks whether the realsense pipeline is started or stopped.
-// this is shut down when we go into low power mode, and otherwise
-// started when input is received.
-bool rs_pipeline_active = true;
-
 // the edge detection functionality will threshold at this value
 // note that the end result may include values higher than this -- 
 // this threshold is only applied before the Laplacian is applied
@@ -28,9 +20,10 @@ bool rs_pipeline_active = true;
 // so do false edges)
 #define MAX_DEPTH_THRESHOLD 5
 
-#define MAX_LABELS 200
-float label_depths[MAX_LABELS];
-uint label_counts[MAX_LABELS];
+// depth is kept in whole millimetres from capture to classification, and only
+// turned into meters where the audio delays are worked out
+#define NEAR_THRESHOLD_MM 1000
+#define MID_THRESHOLD_MM 2500
 
 // keeps track of when the user requested sampling be started
 std::chrono::time_point<std::chrono::high_resolution_clock> sampling_start_time;
@@ -45,9 +38,160 @@ int obstacle_class = 999;
 #define wait_for_warning_after_sample_ms 2000
 #define wait_for_warning_after_warning_ms 500
 
-// we will attempt to decimate down to this width, but decimation is an integer value
-// so the actual decimated width may be slightly different.
-#define DESIRED_FRAME_WIDTH 200
+// the decimated frame is kept between samples so its buffer is only allocated once,
+// and likewise the edge mask, the segmenter's tables, the floor, the occupancy counts
+// and the polar histogram. Each is only used by one stage (see pipeline_frame)
+cv::Mat decimated_depth;
+cv::Mat edge_mask;
+depth_segmenter segmenter;
+ground_plane ground;
+occupancy_map occupancy;
+polar_histogram polar;
+change_detector frame_gate;
+
+// whether the floor is left out of the obstacle classification. Turned off by --keep-floor
+bool use_floor_removal = true;
+
+// the directions of the clap pointers played when the user clicks, in degrees
+#define CLAP_POINTER_COUNT 3
+const int clap_thetas[CLAP_POINTER_COUNT] = {-32, 0, 32};
+
+// Only some of each frame is actually read: the band covered by the obstacle
+// classifier's zones, and the band around the horizon the polar histogram reads. So
+// rather than running every stage over the whole frame, each stage only works on
+// the region the next stage reads plus the halo its kernel needs, working back
+// from those pixels. Turning this off (--full-frame) processes everything, which
+// is handy with the visualisation windows.
+bool use_regions_of_interest = true;
+
+// how far outside their output each stage reads
+#define MEDIAN_HALO 2
+#define LAPLACIAN_HALO 1
+#define DILATE_HALO 1
+
+struct processing_regions
+{
+  cv::Rect filter;    // median and hole filling
+  cv::Rect edges;     // building the edge mask (the Laplacian and dilation)
+  cv::Rect segment;   // labelling and painting the label means
+  cv::Rect classify;  // the zones read by the classifier
+};
+
+// The obstacle classifier looks at a grid of zones, each a fifth of the frame
+// across. The rows are the same height and centred, so the middle zone is the
+// middle 1/5th of the frame, which used to be the only zone we looked at. The
+// rows need the same parity as the columns to stay centred
+#define ZONE_COLUMNS 5
+#define ZONE_ROWS 3
+
+// each zone's class from the last frame: 1 for near, 2 for mid and 3 for clear
+uint8_t zone_classes[ZONE_ROWS][ZONE_COLUMNS];
+
+// the last classification, which is reused for frames that are skipped because
+// nothing has changed
+struct classification
+{
+  int obstacle_class;
+  int warning_column;
+  cv::Size frame;
+};
+classification last_classification = {3, ZONE_COLUMNS / 2, cv::Size()};
+
+cv::Rect get_zone(cv::Size frame, int row, int col)
+{
+  int first_row = (ZONE_COLUMNS - ZONE_ROWS) / 2;
+  int x_start = col * frame.width / ZONE_COLUMNS;
+  int x_end = (col + 1) * frame.width / ZONE_COLUMNS;
+  int y_start = (first_row + row) * frame.height / ZONE_COLUMNS;
+  int y_end = (first_row + row + 1) * frame.height / ZONE_COLUMNS;
+  return cv::Rect(x_start, y_start, x_end - x_start, y_end - y_start);
+}
+
+// the first of the grid's columns when only zone_columns of them are classified,
+// from the middle out
+int get_first_zone_column(int zone_columns)
+{
+  return (ZONE_COLUMNS - zone_columns) / 2;
+}
+
+// the part of the frame covered by the grid, or by its middle zone_columns
+cv::Rect get_classification_zone(cv::Size frame, int zone_columns = ZONE_COLUMNS)
+{
+  int first = get_first_zone_column(zone_columns);
+  return get_zone(frame, 0, first) | get_zone(frame, ZONE_ROWS - 1, first + zone_columns - 1);
+}
+
+// the column a clap pointer at theta degrees samples, looked up from the camera's
+// rays. If they weren't built for this frame size, theta is spread evenly across the
+// FOV instead, e.g. given an FOV of 90 and a theta of -30, we are about 16.7% across
+int get_clap_column(float theta, int width)
+{
+  if (rays.width == width) return rays.get_column(theta);
+
+  int x = width * (theta + fovwidth / 2) / fovwidth;
+  return std::min(std::max(x, 0), width - 1);
+}
+
+// the rows within polar_band_degrees of the horizon, across the whole frame. This
+// is at least the middle row
+cv::Rect get_polar_band(cv::Size frame)
+{
+  int first = frame.height / 2;
+  int last = frame.height / 2;
+  if (rays.height == frame.height) {
+    while (first > 0 && rays.elevations[first - 1] <= polar_band_degrees) first--;
+    while (last + 1 < frame.height && rays.elevations[last + 1] >= -polar_band_degrees) last++;
+  } else if (fovheight > 0) {
+    int rows = polar_band_degrees * frame.height / fovheight;
+    first = std::max(first - rows, 0);
+    last = std::min(last + rows, frame.height - 1);
+  }
+  return cv::Rect(0, first, frame.width, last - first + 1);
+}
+
+// how much sample() decimates frames this wide. The camera is asked for the
+// smallest resolution that covers DESIRED_FRAME_WIDTH, but on the D435i that's
+// 424x240, so frames are still decimated by 2 (to 212x120). Only a replay of
+// frames already close to DESIRED_FRAME_WIDTH skips it
+int get_decimation_amount(int width)
+{
+  return std::max(width / DESIRED_FRAME_WIDTH, 1);
+}
+
+cv::Rect expand_region(cv::Rect region, int halo, cv::Size frame)
+{
+  cv::Rect expanded(region.x - halo, region.y - halo, region.width + 2*halo, region.height + 2*halo);
+  return expanded & cv::Rect(0, 0, frame.width, frame.height);
+}
+
+// plans the regions for classifying the middle zone_columns of the grid. The polar
+// band is only needed for the clap pointers
+processing_regions plan_processing_regions(cv::Size frame, int zone_columns = ZONE_COLUMNS,
+  bool include_polar_band = true)
+{
+  processing_regions regions;
+  regions.classify = get_classification_zone(frame, zone_columns);
+
+  if (!use_regions_of_interest) {
+    regions.segment = cv::Rect(0, 0, frame.width, frame.height);
+  } else if (include_polar_band) {
+    regions.segment = regions.classify | get_polar_band(frame);
+  } else {
+    regions.segment = regions.classify;
+  }
+
+  // the edge mask is built over the whole edges region, which loses the Laplacian's
+  // and then the dilation's halo from what it can be trusted for
+  regions.edges = expand_region(regions.segment, LAPLACIAN_HALO + DILATE_HALO, frame);
+  regions.filter = expand_region(regions.edges, MEDIAN_HALO, frame);
+
+  // a hole takes the nearest depth to its left however far away that is, so the
+  // filter region runs from the left of the frame, which keeps the result the same
+  // as for the whole frame
+  regions.filter.width += regions.filter.x;
+  regions.filter.x = 0;
+  return regions;
+}
 
 float get_ms(std::chrono::time_point<std::chrono::high_resolution_clock> timer)
 {
@@ -57,395 +201,653 @@ float get_ms(std::chrono::time_point<std::chrono::high_resolution_clock> timer)
   return ms;
 }
 
-void hole_filling_filter(cv::Mat mat) {
-  for(int row = 0; row<mat.rows; row++) {
-    for (int col = 0; col<mat.cols; col++) {
-      float distance = mat.at<float>(row, col);
+// the overall proportion of content of the sample zone to satisfy an obstacle is present
+#define CONTENT_THRESHOLD 0.3
 
-      if (distance == 0.0 && col!=0) {
-        mat.at<float>(row, col) = mat.at<float>(row, col-1); 
+// classifies the zone (in the occupancy map's coordinates) as 1 for a near
+// obstacle, 2 for a mid one and 3 for neither
+uint8_t get_obstacle_class(const occupancy_map &occupancy, cv::Rect zone)
+{
+  float sample_n = zone.area();
+  if (sample_n == 0) return 3;
+
+  if (occupancy.count_near(zone) / sample_n > CONTENT_THRESHOLD) return 1;
+  // near pixels count towards mid as well
+  if (occupancy.count_mid(zone) / sample_n > CONTENT_THRESHOLD) return 2;
+  return 3;
+}
+
+// classifies the middle zone_columns of the grid into zone_classes, where the
+// occupancy map covers the frame from origin onwards. The columns either side are
+// taken to be clear. Returns the worst class, and sets worst_column to where it
+// is, going for the column nearest the middle on a tie
+int classify_zones(const occupancy_map &occupancy, cv::Size frame, cv::Point origin, int zone_columns,
+  int &worst_column)
+{
+  worst_column = ZONE_COLUMNS / 2;
+  int worst_class = 4;
+  int first = get_first_zone_column(zone_columns);
+
+  for (int col = 0; col < ZONE_COLUMNS; col++) {
+    for (int row = 0; row < ZONE_ROWS; row++) {
+      bool classified = col >= first && col < first + zone_columns;
+      zone_classes[row][col] = classified ? get_obstacle_class(occupancy, get_zone(frame, row, col) - origin) : 3;
+
+      int from_middle = abs(col - ZONE_COLUMNS / 2);
+      if (zone_classes[row][col] < worst_class ||
+        (zone_classes[row][col] == worst_class && from_middle < abs(worst_column - ZONE_COLUMNS / 2))) {
+        worst_class = zone_classes[row][col];
+        worst_column = col;
       }
     }
   }
+
+  return worst_class;
 }
 
-uint8_t get_overall_obstacle_class_from_thresholds(cv::Mat near, cv::Mat mid)
+// pans a warning towards the middle of a column of the grid, with the same constant
+// power panning as the clap pointers. A warning straight ahead plays at half volume
+// in each ear
+void pan_warning(audio_pointer &pointer, int column, cv::Size frame)
 {
-  assert(near.cols == mid.cols);
-  assert(near.rows == mid.rows);
-
-  // assume we only want to sample the middle 1/5th
-  int samplex_start = 2*near.cols / 5;
-  int samplex_finish = 3*near.cols / 5;
-  int sampley_start = 2*near.rows / 5;
-  int sampley_finish = 3*near.rows / 5;
+  cv::Rect zone = get_zone(frame, 0, column);
+  int x = zone.x + zone.width / 2;
+  float theta = (rays.width == frame.width) ? rays.azimuths[x]
+                                           : ((column + 0.5f) / ZONE_COLUMNS - 0.5f) * fovwidth;
+  float theta_rads = theta * 0.01745329f;
+  pointer.left_amount = 0.5f * (cos(theta_rads) - sin(theta_rads));
+  pointer.right_amount = 0.5f * (cos(theta_rads) + sin(theta_rads));
+}
 
-  int sample_n = (samplex_finish - samplex_start)*(sampley_finish - sampley_start);
+// plays a warning for the obstacle class, unless one was played too recently. A
+// nearer class than the last always gets its warning straight away
+void play_warning(bool user_triggered, const classification &classified)
+{
+  using Clock=std::chrono::high_resolution_clock;
+  int new_obstacle_class = classified.obstacle_class;
 
-  // proportion of zone found so far
-  float near_content = 0;
-  float mid_content = 0;
+  if (!user_triggered && 
+    (get_ms(sampling_start_time) > wait_for_warning_after_sample_ms) && 
+    (get_ms(last_warning_played) > wait_for_warning_after_warning_ms) || new_obstacle_class < obstacle_class) {
+    obstacle_class = new_obstacle_class;
+    audio_pointer warning;
+    switch (obstacle_class) {
+      case 1:
+        warning.delayms = 0;
+        warning.sound_index = SOUND_INDEX_2BEEP;
+        pan_warning(warning, classified.warning_column, classified.frame);
+        play_scene(&warning, 1);
+        last_warning_played = Clock::now();
+        break;
+      case 2:
+        warning.delayms = 0;
+        warning.sound_index = SOUND_INDEX_1BEEP;
+        pan_warning(warning, classified.warning_column, classified.frame);
+        play_scene(&warning, 1);
+        last_warning_played = Clock::now();
+        break;
+    }
+  }
+}
 
-  float content_threshold = 0.3; // the overall proportion of content of the sample zone to satisfy an obstacle is present
+// gets the Z16 frame in millimetres. At the D435i's default depth units this is
+// the frame itself, so nothing is converted or copied
+cv::Mat convert_to_millimetres(const cv::Mat &depth, float depth_scale)
+{
+  if (fabs(depth_scale - 0.001f) < 1e-6) return depth;
 
-  for (int x = samplex_start; x<samplex_finish; x++)
-  {
-    for (int y = sampley_start; y < sampley_finish; y++)
-    {
-      float nearval = near.at<float>(y,x);
-      float midval = mid.at<float>(y,x);
-      
-      if (nearval > 0.01) {
-        near_content += 1.0/sample_n;
-        mid_content += 1.0/sample_n;
-      } else if (midval > 0.01) {
-        mid_content += 1.0/sample_n;
-      }
+  cv::Mat mm;
+  depth.convertTo(mm, CV_16U, depth_scale * 1000);
+  return mm;
+}
 
-      if (near_content > content_threshold) {
-        return 1;
-      }
-    }
+// starts the output for a sample the user asked for
+void begin_user_sample()
+{
+  screen.clear_screen();
+  screen.post("Click reached the sampler after %fms (%fms on average, %fms at most)\n",
+    control.last_wake_ms, control.total_wake_ms / control.wakes, control.max_wake_ms);
+  if (scene_latency.scenes > 0) {
+    screen.post("Sounds started %fms after being queued (%fms on average, %fms at most, %lu dropped)\n",
+      scene_latency.last_ms.load(), scene_latency.total_ms / scene_latency.scenes,
+      scene_latency.max_ms.load(), scene_latency.dropped.load());
   }
 
-  return (mid_content > content_threshold) ? 2 : 3;
+  frame_gate.frames_checked = 0;
+  frame_gate.frames_skipped = 0;
+  scheduler.frames_skipped_for_rate = 0;
+  scheduler.frames_skipped_as_late = 0;
 }
 
-cv::Mat convert_to_opencvmat(rs2::depth_frame depth)
+// What each stage of processing a frame hands to the next. The stages only share
+// what's in here, so that they can run on different threads (see pipeline.cpp),
+// and the matrices keep their buffers from one frame to the next.
+struct pipeline_frame
 {
-  return depth_frame_to_meters(*p, depth);
-}
+  bool user_triggered;
+  // the frame wasn't processed, as it looked just like the last one or the
+  // scheduler passed over it. The last classification still stands, and nothing
+  // else here is set
+  bool skipped;
+  std::chrono::time_point<std::chrono::high_resolution_clock> stopwatch;
+  // when the frame arrived from the source
+  std::chrono::steady_clock::time_point arrived;
+  cv::Size frame_size;
+  processing_regions regions;
+  // how many columns of the grid are classified, from the middle out
+  int zone_columns;
+  bool floor_found;
+  // the nearest depth in millimetres for each clap pointer, from the polar histogram
+  // bin it falls in. Only set for frames the user asked for
+  uint16_t clap_depths[CLAP_POINTER_COUNT];
+  int clap_bins[CLAP_POINTER_COUNT];
+
+  // the whole frame in millimetres, which is only set inside regions.filter
+  cv::Mat distances;
+  // regions.segment, with each section replaced by its mean once it's been segmented
+  cv::Mat sections;
+  // the floor over regions.segment, when floor_found
+  cv::Mat floor;
+
+  // copies everything but the matrices
+  void copy_details_to(pipeline_frame &out) const
+  {
+    out.user_triggered = user_triggered;
+    out.skipped = skipped;
+    out.stopwatch = stopwatch;
+    out.arrived = arrived;
+    out.frame_size = frame_size;
+    out.regions = regions;
+    out.zone_columns = zone_columns;
+    out.floor_found = floor_found;
+    memcpy(out.clap_depths, clap_depths, sizeof(clap_depths));
+    memcpy(out.clap_bins, clap_bins, sizeof(clap_bins));
+  }
+};
 
-void sample(bool user_triggered)
+// The first stage: waits for the next frame, and filters it. This is also where
+// the frames that don't need processing are picked out, and where the floor and
+// the polar histogram are found, as both need the distances before they're
+// segmented. Returns false if there are no more frames
+bool capture_and_filter(bool user_triggered, pipeline_frame &out)
 {
   using namespace cv;
   using Clock=std::chrono::high_resolution_clock;
-  if (user_triggered) { 
-    clear();
-    // set our obstacle class back to 999 to reset
-    obstacle_class = 999;
-    printw("Time since warning: %f", get_ms(last_warning_played));
-    last_warning_played = std::chrono::high_resolution_clock::now();
+  if (user_triggered) begin_user_sample();
+  out.stopwatch = Clock::now();
+  auto stopwatch = out.stopwatch;
+  if (user_triggered) screen.post("[%f]: Waiting for frame\n", get_ms(stopwatch));
+  // even while we're watching for obstacles this waits for the camera, so the
+  // thread sleeps between frames rather than polling for them
+  depth_frame_data frame;
+  if (!source->wait_for_frame(frame)) return false;
+  out.arrived = std::chrono::steady_clock::now();
+
+  // a click while we were waiting gets this frame, rather than waiting for the next
+  if (!user_triggered && control.take_click()) {
+    user_triggered = true;
+    begin_user_sample();
+  }
+  out.user_triggered = user_triggered;
+
+  // the scheduler passes over frames we don't have the time or the need for, and if
+  // the new frame looks just like the last one we processed, the last
+  // classification still stands
+  out.skipped = use_frame_scheduler &&
+    !scheduler.should_process(out.arrived, source->last_frame_age_ms, user_triggered);
+  if (!out.skipped) {
+    out.skipped = use_frame_gating && !frame_gate.should_process(frame.depth, frame.depth_scale, user_triggered);
   }
-  auto stopwatch = Clock::now();
-  if (user_triggered) printw("[%f]: Waiting for frame\n", get_ms(stopwatch));
-  // Block program until frames arrive
-  rs2::frameset frames = p->wait_for_frames();
-
-  if (use_visualisation) {
-    rs2::video_frame img = frames.get_color_frame();
-    imshow(open_cv_window_1, frame_to_mat(img));
+  if (out.skipped) return true;
+
+  if (use_visualisation && !frame.color.empty()) {
+    imshow(open_cv_window_1, frame.color);
   }
 
-  if (user_triggered) printw("[%f]: Captured frame\n", get_ms(stopwatch));
+  if (user_triggered) screen.post("[%f]: Captured frame %fms old (%lu of %lu frames dropped)\n",
+    get_ms(stopwatch), source->last_frame_age_ms,
+    source->frames_dropped.load(), source->frames_received.load());
 
-  // Try to get a frame of a depth image
-  rs2::depth_frame depth = frames.get_depth_frame();
+  cv::Mat depth = frame.depth;
 
   // Decimate the frame to reduce the dataset size
-  if (depth.get_width() > DESIRED_FRAME_WIDTH) {
-    int pre_width = depth.get_width();
-    int decimation_amount = pre_width / DESIRED_FRAME_WIDTH;
-    rs2::decimation_filter decimation_filter;
-    decimation_filter.set_option(RS2_OPTION_FILTER_MAGNITUDE, decimation_amount);
-    depth = decimation_filter.process(depth);
-
-    if (user_triggered) printw("[%f]: Decimated frame\n", get_ms(stopwatch));
+  int decimation_amount = get_decimation_amount(depth.cols);
+  cv::Size frame_size(depth.cols, depth.rows);
+  if (decimation_amount > 1) {
+    frame_size = cv::Size(depth.cols / decimation_amount, depth.rows / decimation_amount);
+  }
+  out.frame_size = frame_size;
+
+  // work out which pixels each stage has to produce. Only the user's frames need
+  // the polar band for the clap pointers, and while there's nothing in the way the
+  // scheduler may only want the middle of the grid
+  out.zone_columns = user_triggered || !use_frame_scheduler ? ZONE_COLUMNS : scheduler.get_zone_columns(ZONE_COLUMNS);
+  processing_regions regions = plan_processing_regions(frame_size, out.zone_columns, user_triggered);
+  out.regions = regions;
+
+  if (decimation_amount > 1) {
+    decimate_depth(frame.depth, decimated_depth, decimation_amount, regions.filter);
+    depth = decimated_depth;
+
+    if (user_triggered) screen.post("[%f]: Decimated frame\n", get_ms(stopwatch));
   }
 
-  // convert to an OpenCV matrix of meters
-  auto distances = convert_to_opencvmat(depth);
+  // convert to an OpenCV matrix of millimetres
+  auto millimetres = convert_to_millimetres(depth(regions.filter), frame.depth_scale);
 
-  if (user_triggered) printw("[%f]: Converted to matrix\n", get_ms(stopwatch));
+  if (user_triggered) screen.post("[%f]: Converted to matrix\n", get_ms(stopwatch));
 
-  cv::medianBlur(distances, distances, 5);
+  // this also copies the frame out of the camera's memory, which is read-only.
+  // Outside the filter region the distances are never read, so are left unset
+  out.distances.create(frame_size, CV_16UC1);
+  Mat distances = out.distances;
+  Mat filtered = distances(regions.filter);
+  median_filter_5x5(millimetres, filtered);
 
-  if (user_triggered) printw("[%f]: Median filter applied\n", get_ms(stopwatch));
+  if (user_triggered) screen.post("[%f]: Median filter applied\n", get_ms(stopwatch));
 
-  hole_filling_filter(distances);
+  hole_filling_filter(filtered);
 
-  if (user_triggered) printw("[%f]: Hole-filling filter applied\n", get_ms(stopwatch));
-  visualise_distance(distances, 2);
+  if (user_triggered) screen.post("[%f]: Hole-filling filter applied\n", get_ms(stopwatch));
+  visualise_distance(filtered, 2, VISUALISE_MM_SCALE);
 
-  auto distance_vect = distances.reshape(1, distances.rows * distances.cols);
-  distance_vect.convertTo(distance_vect, CV_32F);
+  // reduce the band around the horizon to the nearest depth in each direction, for
+  // the clap pointers. Like the floor, this is read before the segmentation
+  // replaces the distances with each section's mean
+  if (user_triggered) {
+    polar.build(distances(get_polar_band(frame_size)), polar_bin_count, polar_percentile);
 
-  Mat laplaced;
-  distances.convertTo(laplaced, CV_8U);
-  visualise_distance(distances, 2);
+    screen.post("[%f]: Polar histogram (m):", get_ms(stopwatch));
+    for (size_t bin = 0; bin < polar.bins.size(); bin++) {
+      screen.post(" %.1f", polar.bins[bin] / 1000.0f);
+    }
+    screen.post("\n");
 
-  for (uint i=0; i<laplaced.rows*laplaced.cols; i++) {
-    if (laplaced.at<uint8_t>(i) > MAX_DEPTH_THRESHOLD) {
-      laplaced.at<uint8_t>(i) = MAX_DEPTH_THRESHOLD;
+    // convert each clap pointer's theta to a column, and read the nearest depth
+    // around it from the polar histogram
+    for (int i = 0; i < CLAP_POINTER_COUNT; i++) {
+      out.clap_bins[i] = polar.get_bin(get_clap_column(clap_thetas[i], frame_size.width));
+      out.clap_depths[i] = polar.bins[out.clap_bins[i]];
     }
   }
 
-  if (user_triggered) printw("[%f]: Clamped maximum depth\n", get_ms(stopwatch));
-  // cv::GaussianBlur(laplaced, laplaced, cv::Size(7,7), 0, 0);
-  cv::Laplacian(laplaced, laplaced, CV_8U, 3, 1, 0, BORDER_DEFAULT);
+  // find the floor before the segmentation replaces the distances with each section's mean
+  out.floor_found = false;
+  if (use_floor_removal) {
+    Mat segment_distances = distances(regions.segment);
+    ground.estimate(segment_distances, regions.segment.tl(), frame.gravity);
+    ground.mask_floor(segment_distances, regions.segment.tl(), out.floor);
+    out.floor_found = ground.found;
 
-  if (user_triggered) printw("[%f]: Laplacian applied\n", get_ms(stopwatch));
+    if (user_triggered) {
+      if (ground.found) {
+        screen.post("[%f]: Found the floor %fm below from %d points\n", get_ms(stopwatch), ground.offset, ground.inliers);
+      } else {
+        screen.post("[%f]: No floor found\n", get_ms(stopwatch));
+      }
+    }
+  }
 
-  auto edge_strel = cv::getStructuringElement(cv::MORPH_ELLIPSE, cv::Size(3,3));
+  scheduler.report_cost(0, out.arrived);
+  return true;
+}
 
-  // dilate to close any small gaps in the edges, like near the window border
-  cv::dilate(laplaced, laplaced, edge_strel);
+// The second stage: splits the segment region of the frame into the sections
+// enclosed by edges, and replaces the distances in each with its mean
+void segment_frame(const pipeline_frame &in, pipeline_frame &out)
+{
+  using namespace cv;
+  in.copy_details_to(out);
+  if (in.skipped) return;
 
-  for (uint i=0; i<laplaced.rows * laplaced.cols; i++) {
-    bool edge = laplaced.at<uint8_t>(i) != 0;
+  auto started = std::chrono::steady_clock::now();
+  auto stopwatch = in.stopwatch;
+  bool user_triggered = in.user_triggered;
+  const processing_regions &regions = in.regions;
 
-    laplaced.at<uint8_t>(i) = edge ? 0 : 1;
-  }
+  // find the edges between objects from the depth (clamped to MAX_DEPTH_THRESHOLD),
+  // dilated to close any small gaps in them, like near the window border. This
+  // leaves a mask of the regions enclosed by the edges
+  build_edge_mask(in.distances(regions.edges), edge_mask, MAX_DEPTH_THRESHOLD, edge_detector);
+
+  if (user_triggered) screen.post("[%f]: Edges found\n", get_ms(stopwatch));
 
-  auto labelled = laplaced.clone();
-  // apply unique labels to the sections enclosed in edges
-  cv::connectedComponents(laplaced, labelled);
+  // only the middle of the edges region is right, since the edges are found from
+  // the pixels around them
+  Mat edges = edge_mask(regions.segment - regions.edges.tl());
 
-  uint max_label = 0;
+  // apply unique labels to the sections enclosed in edges, and replace the
+  // distances in each with its mean. While watching for obstacles, only the parts
+  // of the frame whose edges have changed since the last frame are labelled again
+  in.distances(regions.segment).copyTo(out.sections);
+  if (in.floor_found) in.floor.copyTo(out.floor);
+  int component_count = segmenter.segment(edges, out.sections, !user_triggered);
 
-  // accumulate the depths for each label
-  for (uint i = 0; i <labelled.rows*labelled.cols; i++) {
-    uint labeli = labelled.at<uint>(i);
-    if (max_label < labeli) max_label = labeli;
+  if (user_triggered) screen.post("[%f]: Assigned %d labels\n", get_ms(stopwatch), component_count);
 
-    label_depths[labeli] += distances.at<float>(i);
-    label_counts[labeli]++;
+  visualise_distance(segmenter.labels, 3);
+  scheduler.report_cost(1, started);
+}
+
+// plays the clap pointers for a frame the user asked for
+void play_claps(const pipeline_frame &frame)
+{
+  // Get the depth frame's dimensions
+  int width = frame.frame_size.width;
+
+  // fill our samples
+  audio_pointer claps[CLAP_POINTER_COUNT];
+
+  screen.post("Captured frame with width %d\n", width);
+
+  for (int i = 0; i < CLAP_POINTER_COUNT; i++)
+  {
+    float theta = clap_thetas[i];
+
+    claps[i].delayms = frame.clap_depths[i] * METERS_TO_DELAY_MS / 1000;
+    claps[i].sound_index = 0; // set this pointer to be our clap sound
+
+    // convert theta to rads by multiplying by pi/180
+    float theta_rads = theta * 0.01745329f;
+
+    // using constant power panning, the sound is panned to the left and right
+    // ears using trigonometric rules and scaled by sqrt(2)/2.
+    claps[i].left_amount = 0.707107f * (cos(theta_rads) - sin(theta_rads));
+    claps[i].right_amount = 0.707107f * (cos(theta_rads) + sin(theta_rads));
+
+    if (claps[i].delayms == 0)
+    {
+      claps[i].left_amount = 0;
+      claps[i].right_amount = 0;
+    } 
+    // if this pointer has exactly the same delay as the one to the left, add a little delay
+    else if (i == 2 && claps[i].delayms == claps[0].delayms)
+    {
+      claps[i].delayms += 50;
+    }
+    else if (i > 0 && claps[i].delayms == claps[i-1].delayms)
+    {
+      claps[i].delayms += 50;
+    }
+    
+    screen.post("Created sample from bin %d, theta=%f, %dms delay, volume %f %f\n",
+      frame.clap_bins[i],
+      theta,
+      claps[i].delayms,
+      claps[i].left_amount,
+      claps[i].right_amount
+      );
   }
 
-  if (max_label >= MAX_LABELS) max_label = MAX_LABELS -1;
+  play_scene(claps, CLAP_POINTER_COUNT);
+}
+
+// the frames the user asked for which have been captured, and classified. When the
+// pipeline is stopped with one of them still inside, its click is handed back
+// rather than lost
+unsigned long user_frames_captured = 0;
+unsigned long user_frames_classified = 0;
 
-  uint largest_depth = 0;
+// The last stage: classifies the obstacles in the segmented frame and plays the
+// warnings, and the clap pointers if the user asked for the frame. This has to
+// run on the sampling thread, as it's the only one which queues sounds
+void classify_frame(const pipeline_frame &frame)
+{
+  using Clock=std::chrono::high_resolution_clock;
+  bool user_triggered = frame.user_triggered;
 
-  // take the mean
-  for (uint labeli = 0; labeli<=max_label; labeli++) {
-    label_depths[labeli] = label_depths[labeli] / label_counts[labeli];
+  if (user_triggered) {
+    user_frames_classified++;
+    screen.post("Time since warning: %f\n", get_ms(last_warning_played));
+    // set our obstacle class back to 999 to reset
+    obstacle_class = 999;
+    last_warning_played = Clock::now();
   }
 
-  if (user_triggered) printw("[%f]: Assigned %u labels\n", get_ms(stopwatch), max_label);
+  if (frame.skipped) {
+    play_warning(false, last_classification);
+    return;
+  }
+
+  auto started = std::chrono::steady_clock::now();
+  auto stopwatch = frame.stopwatch;
+  const processing_regions &regions = frame.regions;
   
+  // perform object detection through distance classification, counting the near
+  // and mid pixels over everything we've segmented that isn't floor
+  occupancy.build(frame.sections, NEAR_THRESHOLD_MM, MID_THRESHOLD_MM, frame.floor_found ? frame.floor : cv::Mat());
+  int warning_column;
+  int new_obstacle_class = classify_zones(occupancy, frame.frame_size, regions.segment.tl(), frame.zone_columns,
+    warning_column);
+  scheduler.report_class(new_obstacle_class);
 
-  // in one step, fill any pixels marked as edges from the left or top
-  // (since these weren't labelled properly in the labelling step) and
-  // also apply the label means to the distances array
-  for (uint row=0; row<labelled.rows; row++) {
-    for (uint col=0; col<labelled.cols; col++) {
-      // flood fill every 2nd value from the left
-      if (laplaced.at<uint8_t>(row,col)==0) {
-        if (col!=0) {
-          laplaced.at<uint8_t>(row,col) = laplaced.at<uint8_t>(row, col-1);
-        }
-      } else {
-        uint labeli = labelled.at<uint>(row,col);
-        float mean_depth = label_depths[labeli];
-        distances.at<float>(row, col) = mean_depth;
+  if (user_triggered) {
+    screen.post("[%f]: obstacle class: %d\n", get_ms(stopwatch), obstacle_class);
+    for (int row = 0; row < ZONE_ROWS; row++) {
+      for (int col = 0; col < ZONE_COLUMNS; col++) {
+        screen.post(" %d", zone_classes[row][col]);
       }
+      screen.post("\n");
     }
   }
 
-  visualise_distance(labelled, 3);
-  
-  // perform object detection through distance classification
-
-  float nearThresh = 1;
-  float midThresh = 2.5;
-
-  cv::Mat near = distances.clone();
-  near = near.reshape(1, near.rows);
-  cv::Mat mid = near.clone();
-
-  for (uint i=0; i<distances.rows * distances.cols; i++) {
-    if (near.at<float>(i) < nearThresh) {
-      near.at<float>(i) = nearThresh;
-      mid.at<float>(i) = midThresh;
-    } else if (near.at<float>(i) < midThresh) {
-      near.at<float>(i) = 0;
-      mid.at<float>(i) = midThresh;
-    } else {
-      near.at<float>(i) = 0;
-      mid.at<float>(i) = 0;
-    }
+  visualise_distance(frame.sections, 4, VISUALISE_MM_SCALE);
+
+  if (user_triggered) screen.post("[%f]: thresholded\n", get_ms(stopwatch));
+
+  if (user_triggered) screen.post("[%f]: classified\n", get_ms(stopwatch));
+
+  last_classification.obstacle_class = new_obstacle_class;
+  last_classification.warning_column = warning_column;
+  last_classification.frame = frame.frame_size;
+  play_warning(user_triggered, last_classification);
+  scheduler.report_cost(2, started);
+
+  // create our "clap" audio pointers
+  if (user_triggered) {
+    play_claps(frame);
+    sampling_start_time = Clock::now();
   }
+}
 
-  int new_obstacle_class = get_overall_obstacle_class_from_thresholds(near, mid);
+// Runs capture_and_filter and segment_frame on threads of their own while we're
+// watching for obstacles. That leaves the sampling thread to classify, so it's
+// still the only thread queueing sounds. Turned off with --no-pipeline, and
+// whenever the visualisation is on, as its windows have to be drawn from one thread
+bool use_pipeline = true;
 
-  if (user_triggered) printw("[%f]: obstacle class: %d\n", get_ms(stopwatch), obstacle_class);
+// set before the pipeline is started for a click, so its first frame is the user's
+std::atomic<bool> pipeline_user_sample(false);
 
-  visualise_distance(distances, 4);
+bool capture_stage(pipeline_frame &out);
+staged_pipeline<pipeline_frame> pipeline(capture_stage, segment_frame, classify_frame);
 
-  if (user_triggered) printw("[%f]: thresholded\n", get_ms(stopwatch));
+bool capture_stage(pipeline_frame &out)
+{
+  // a frame the user asked for goes through on its own, so that it can't be dropped
+  // and its timings aren't mixed up with other frames'
+  static bool last_was_user_triggered = false;
+  if (last_was_user_triggered && !pipeline.wait_for_last_stage()) return false;
+
+  if (!capture_and_filter(pipeline_user_sample.exchange(false), out)) return false;
+  pipeline.first_stage_input_arrived(out.arrived);
+  last_was_user_triggered = out.user_triggered;
+  if (out.user_triggered) user_frames_captured++;
+  return true;
+}
 
-  if (user_triggered) printw("[%f]: classified\n", get_ms(stopwatch));
+bool pipelined()
+{
+  return use_pipeline && !use_visualisation;
+}
 
-  if (!user_triggered && 
-    (get_ms(sampling_start_time) > wait_for_warning_after_sample_ms) && 
-    (get_ms(last_warning_played) > wait_for_warning_after_warning_ms) || new_obstacle_class < obstacle_class) {
-    obstacle_class = new_obstacle_class;
-    switch (obstacle_class) {
-      case 1:
-        audio_pointers_count = 1;
-        audio_pointers[0].delayms = 0;
-        audio_pointers[0].sound_index = SOUND_INDEX_2BEEP;
-        audio_pointers[0].left_amount = 0.5;
-        audio_pointers[0].right_amount = 0.5;
-        last_warning_played = Clock::now();
-        sound_ready = true;
-        break;
-      case 2:
-        audio_pointers_count = 1;
-        audio_pointers[0].delayms = 0;
-        audio_pointers[0].sound_index = SOUND_INDEX_1BEEP;
-        audio_pointers[0].left_amount = 0.5;
-        audio_pointers[0].right_amount = 0.5;
-        last_warning_played = Clock::now();
-        sound_ready = true;
-        break;
-    }
+// the frames for running the stages one after another, when they aren't pipelined
+pipeline_frame serial_filtered;
+pipeline_frame serial_segmented;
+
+// samples the next frame, returning false if there isn't one
+bool sample(bool user_triggered)
+{
+  if (!capture_and_filter(user_triggered, serial_filtered)) return false;
+  segment_frame(serial_filtered, serial_segmented);
+  classify_frame(serial_segmented);
+
+  update_vis();
+  return true;
+}
+
+// starts watching for obstacles after a click, sampling the first frame for the user
+void start_detecting()
+{
+  if (!pipelined()) {
+    sample(true);
+    return;
   }
 
-  // create our "clap" audio pointers
-  if (user_triggered) {
-    // Get the depth frame's dimensions
-    float width = distances.cols;
-    float height = distances.rows;
-    float x_pixels_per_theta = width / fovwidth;
+  pipeline_user_sample = true;
+  user_frames_captured = 0;
+  user_frames_classified = 0;
+  pipeline.start();
+  pipeline.finish_next();
+}
 
-    // fill our samples
-    audio_pointers_count = 3;
-    int sample_thetas[audio_pointers_count] = {-32, 0, 32};
+// samples the next frame while watching for obstacles, returning false if there isn't one
+bool detect_next()
+{
+  return pipelined() ? pipeline.finish_next() : sample(false);
+}
 
-    printw("Captured frame with width %f\n", width);
+// stops watching for obstacles. Returns true if a frame taken for a click was
+// thrown away with the rest of the pipeline, so the click still needs a sample
+bool stop_detecting()
+{
+  if (!pipeline.is_running()) return false;
 
-    for (int i = 0; i < audio_pointers_count; i++)
-    {
-      float theta = sample_thetas[i];
-
-      // convert our sample theta to a pixel value
-      // e.g. given an FOV of 90, and a theta of -30, we are about 16.7% across
-      // the depth frame
-      int x = width * (theta + fovwidth / 2) / fovwidth;
-      int y = height / 2;
-
-      audio_pointers[i].delayms = distances.at<float>(y, x) * METERS_TO_DELAY_MS;
-      audio_pointers[i].sound_index = 0; // set this pointer to be our clap sound
-
-      // convert theta to rads by multiplying by pi/180
-      float theta_rads = theta * 0.01745329f;
-
-      // using constant power panning, the sound is panned to the left and right
-      // ears using trigonometric rules and scaled by sqrt(2)/2.
-      audio_pointers[i].left_amount = 0.707107f * (cos(theta_rads) - sin(theta_rads));
-      audio_pointers[i].right_amount = 0.707107f * (cos(theta_rads) + sin(theta_rads));
-
-      if (audio_pointers[i].delayms == 0)
-      {
-        audio_pointers[i].left_amount = 0;
-        audio_pointers[i].right_amount = 0;
-      } 
-      // if this pointer has exactly the same delay as the one to the left, add a little delay
-      else if (i == 2 && audio_pointers[i].delayms == audio_pointers[0].delayms)
-      {
-        audio_pointers[i].delayms += 50;
-      }
-      else if (i > 0 && audio_pointers[i].delayms == audio_pointers[i-1].delayms)
-      {
-        audio_pointers[i].delayms += 50;
-      }
-      
-      printw("Created sample at x=%d, y=%d, theta=%f, %dms delay, volume %f %f\n",
-        x,
-        y,
-        theta,
-        audio_pointers[i].delayms,
-        audio_pointers[i].left_amount,
-        audio_pointers[i].right_amount
-        );
-
-      refresh();
-    }
+  pipeline.stop();
+  return user_frames_classified < user_frames_captured;
+}
 
-    sound_ready = true;
+void print_scheduler_stats()
+{
+  if (!use_frame_scheduler) return;
 
-    if (user_triggered) {
-      sampling_start_time = Clock::now();
+  screen.post("Scheduler skipped %lu frames to keep to %.0fms between frames, and %lu that would have missed their %.0fms deadline\n",
+    scheduler.frames_skipped_for_rate.load(), scheduler.get_interval_ms(),
+    scheduler.frames_skipped_as_late.load(), scheduler.get_deadline_ms());
+  screen.post("Stages cost %.2fms, %.2fms and %.2fms per frame\n", scheduler.get_stage_cost_ms(0),
+    scheduler.get_stage_cost_ms(1), scheduler.get_stage_cost_ms(2));
+}
+
+void print_pipeline_stats()
+{
+  if (!pipelined()) return;
+
+  const char *names[PIPELINE_STAGES] = {"capture+filter", "segment", "classify+audio"};
+  float seconds = pipeline.get_running_seconds();
+  for (int stage = 0; stage < PIPELINE_STAGES; stage++) {
+    unsigned long frames = pipeline.stats[stage].frames;
+    screen.post("%-15s %5lu frames, %5.1f fps, %6.2fms each", names[stage], frames,
+      seconds > 0 ? frames / seconds : 0.0f, frames > 0 ? pipeline.stats[stage].busy_ms / frames : 0.0);
+    if (stage > 0) {
+      screen.post(", %u queued (%u at most), %lu dropped", pipeline.queue_depth(stage),
+        pipeline.max_queue_depth(stage), pipeline.frames_dropped(stage));
     }
+    screen.post("\n");
   }
-
-  update_vis();
+  screen.post("%s", thread_setup.describe_pipeline_grants().c_str());
 }
 
-void reset_labels(){
-  // initialise the mean depths to 0
-  for (uint labeli = 0; labeli<MAX_LABELS; labeli++) {
-    label_depths[labeli] = 0;
-    label_counts[labeli] = 0;
-  }
+// plays one of the short beeps used to say what the sampler is doing
+void play_status_sound(int sound_index, int delayms)
+{
+  audio_pointer status;
+  status.sound_index = sound_index;
+  status.left_amount = 0.5;
+  status.right_amount = 0.5;
+  status.delayms = delayms;
+  play_scene(&status, 1);
 }
 
+// Moves between the states in control.cpp. Every state blocks on something - the
+// input loop, or the camera while detecting - so the thread only runs when there's
+// work to do
 void sampling_loop()
 {
-    bool in_detection_mode = false;
-    last_warning_played = std::chrono::high_resolution_clock::now();
-    while (1) {
-      // if we're in low power mode, check to see if the pipeline should
-      // be shut down
-      if (low_power_mode) {
-        if (rs_pipeline_active) {
-          clear();
-          printw("Putting pipeline into low-power mode.\n");
-          refresh();
-          p->stop();
-          rs_pipeline_active = false;
+  sampler_state state = SAMPLER_IDLE;
+  if (use_memory_locking) prefault_stack();
+  last_warning_played = std::chrono::high_resolution_clock::now();
+
+  while (!control.quitting()) {
+    switch (state) {
+      case SAMPLER_IDLE:
+        if (control.low_power()) {
+          screen.clear_screen();
+          screen.post("Putting pipeline into low-power mode.\n");
+          source->stop();
           // play a shutdown sound
-          audio_pointers_count = 1;
-          audio_pointers[0].sound_index = SOUND_INDEX_2BEEP;
-          audio_pointers[0].left_amount = 0.5;
-          audio_pointers[0].right_amount = 0.5;
-          audio_pointers[0].delayms = 0;
-          sound_ready = true;
+          play_status_sound(SOUND_INDEX_2BEEP, 0);
+          state = SAMPLER_LOW_POWER;
+        } else if (control.take_click()) {
+          start_detecting();
+          state = SAMPLER_DETECTING;
+        } else {
+          // the camera records frames as they arrive, but a replay only moves on
+          // when asked, so keep the frames flowing into the recording. A click
+          // then waits for at most a frame
+          depth_frame_data frame;
+          if (recorder == NULL || !source->wait_for_frame(frame)) control.wait(true);
         }
+        break;
 
-        usleep(100000);
-      } else {
-        // if we've been asked to capture but the pipeline is in low power mode,
-        // wake it back up
-        if (!rs_pipeline_active) {
-          p->start();
-          rs_pipeline_active = true;
-          audio_pointers_count = 1;
-          audio_pointers[0].sound_index = SOUND_INDEX_3BEEP;
-          audio_pointers[0].left_amount = 0.5;
-          audio_pointers[0].right_amount = 0.5;
-          audio_pointers[0].delayms = 100;
-          sound_ready = true;
-          // we can't capture a sample if the pipeline has just started
-          ready_for_sample = false;
-          in_detection_mode = false;
-        }
-        else if (ready_for_sample) {
-          in_detection_mode = true;
+      case SAMPLER_LOW_POWER:
+        control.wait(false);
+        state = SAMPLER_WAKING;
+        break;
+
+      case SAMPLER_WAKING:
+        source->start();
+        play_status_sound(SOUND_INDEX_3BEEP, 100);
+        // the click that woke us doesn't take a sample, as the camera has only just started
+        control.take_click();
+        state = SAMPLER_IDLE;
+        break;
+
+      case SAMPLER_DETECTING:
+        // when pipelined, clicks are picked up with the frames by capture_and_filter
+        if (control.low_power()) {
+          stop_detecting();
+          state = SAMPLER_IDLE;
+        } else if (!pipelined() && control.take_click()) {
           sample(true);
-          reset_labels();
-          ready_for_sample = false;
-        } else if (in_detection_mode && (get_ms(sampling_start_time) < motion_detection_ms)) {
-          sample(false); 
-          reset_labels();
-        } else if (in_detection_mode) {
+        } else if (get_ms(sampling_start_time) >= motion_detection_ms || !detect_next()) {
+          // the click that was lost is taken again, as if the user had just clicked
+          if (stop_detecting()) control.put_back_click();
           // once we've finished detection, play a sound indicating motion detection has finished
-          in_detection_mode = false;
-
-          audio_pointers_count = 1;
-          audio_pointers[0].sound_index = SOUND_INDEX_3BEEP;
-          audio_pointers[0].left_amount = 0.5;
-          audio_pointers[0].right_amount = 0.5;
-          audio_pointers[0].delayms = 500;
-          sound_ready = true;
+          screen.post("Skipped %lu of %lu unchanged frames\n", frame_gate.frames_skipped, frame_gate.frames_checked);
+          print_scheduler_stats();
+          print_pipeline_stats();
+          play_status_sound(SOUND_INDEX_3BEEP, 500);
+          state = SAMPLER_IDLE;
         }
-        usleep(10000);
-      }
+        break;
     }
+  }
+
+  stop_detecting();
+}
+
+// waits for the sampling thread to finish whatever it's doing, and stop
+void stop_sampling_thread()
+{
+  control.request_quit();
+  if (sampling_thread.joinable()) sampling_thread.join();
 }
 
 void start_sampling_thread()
 {
+  pipeline.on_thread_start = [](int stage) {
+    thread_setup.configure_this_thread(stage == 0 ? THREAD_CAPTURE : THREAD_SEGMENT);
+  };
   sampling_thread = std::thread(&sampling_loop);
+  thread_setup.configure(sampling_thread, THREAD_SAMPLING);
 }
\ No newline at end of file
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <stdlib.h>
+
+// Decides how often to process frames while we're watching for obstacles, and how
+// much of each, from the last obstacle class and what the stages have been costing.
+// With something near every frame is processed over the whole grid, as that's when
+// a late warning matters. With something at mid range, or nothing at all, frames
+// are processed less often, and only as often as the CPU budget allows. When
+// nothing is in the way and even that rate is over budget, only the middle columns
+// of the grid are processed.
+//
+// A frame which would be too late for its warning to be any use - because it waited
+// too long for us, and processing it would take it over its deadline - is skipped
+// for the next one, as long as processing a fresh frame would make it in time.
+
+// how often frames are processed for each obstacle class, at most
+#define SCHEDULER_NEAR_INTERVAL_MS 0
+#define SCHEDULER_MID_INTERVAL_MS 66
+#define SCHEDULER_CLEAR_INTERVAL_MS 200
+// a frame this close to its interval is processed rather than waiting another
+// whole frame for the next
+#define SCHEDULER_SLACK_MS 5
+// how long after a frame arrives the warning for it has to be playing
+#define SCHEDULER_NEAR_DEADLINE_MS 150
+#define SCHEDULER_MID_DEADLINE_MS 300
+#define SCHEDULER_CLEAR_DEADLINE_MS 500
+// how much of each new measurement goes into the stage costs
+#define SCHEDULER_COST_SMOOTHING 0.1f
+// how many of the grid's columns are processed when narrowed
+#define SCHEDULER_NARROW_COLUMNS 3
+#define SCHEDULER_STAGES 3
+
+// set with --cpu-budget, in percent of one core
+#define SCHEDULER_DEFAULT_CPU_BUDGET 100
+float cpu_budget_percent = SCHEDULER_DEFAULT_CPU_BUDGET;
+
+// turned off by --process-every-frame, along with the frame gating
+bool use_frame_scheduler = true;
+
+void parse_cpu_budget(const char *arg)
+{
+  cpu_budget_percent = atof(arg);
+  if (cpu_budget_percent <= 0) {
+    throw std::runtime_error(std::string("Invalid CPU budget: ") + arg);
+  }
+}
+
+class frame_scheduler
+{
+  // the last frame's obstacle class, 1 for near, 2 for mid and 3 for clear
+  std::atomic<int> obstacle_class;
+  // how long each stage has been taking per frame, in ms. Each is only written by
+  // its own stage
+  std::atomic<float> stage_costs[SCHEDULER_STAGES];
+  // only touched by the first stage
+  std::chrono::steady_clock::time_point last_processed;
+  bool narrowed = false;
+
+  static float get_ms(std::chrono::steady_clock::duration duration)
+  {
+    return std::chrono::duration_cast<std::chrono::microseconds>(duration).count() / 1e3f;
+  }
+
+  // how often frames can be processed without going over the CPU budget
+  float get_budget_interval_ms()
+  {
+    return get_expected_cost_ms() * 100 / cpu_budget_percent;
+  }
+
+public:
+  // statistics for display
+  std::atomic<unsigned long> frames_skipped_for_rate;
+  std::atomic<unsigned long> frames_skipped_as_late;
+
+  frame_scheduler() : obstacle_class(3), frames_skipped_for_rate(0), frames_skipped_as_late(0)
+  {
+    for (int i = 0; i < SCHEDULER_STAGES; i++) stage_costs[i] = 0;
+  }
+
+  // called by the last stage with each frame's class
+  void report_class(int new_obstacle_class)
+  {
+    obstacle_class = new_obstacle_class;
+  }
+
+  // called by each stage when it has finished a frame it started at started
+  void report_cost(int stage, std::chrono::steady_clock::time_point started)
+  {
+    float ms = get_ms(std::chrono::steady_clock::now() - started);
+    float cost = stage_costs[stage];
+    stage_costs[stage] = cost == 0 ? ms : cost + (ms - cost) * SCHEDULER_COST_SMOOTHING;
+  }
+
+  float get_stage_cost_ms(int stage)
+  {
+    return stage_costs[stage];
+  }
+
+  // how long a frame takes to go through every stage
+  float get_expected_cost_ms()
+  {
+    float cost = 0;
+    for (int i = 0; i < SCHEDULER_STAGES; i++) cost += stage_costs[i];
+    return cost;
+  }
+
+  // how long to leave between processed frames. Something near always gets every
+  // frame, budget or not
+  float get_interval_ms()
+  {
+    switch (obstacle_class) {
+      case 1:
+        return SCHEDULER_NEAR_INTERVAL_MS;
+      case 2:
+        return std::max((float)SCHEDULER_MID_INTERVAL_MS, get_budget_interval_ms());
+      default:
+        return std::max((float)SCHEDULER_CLEAR_INTERVAL_MS, get_budget_interval_ms());
+    }
+  }
+
+  float get_deadline_ms()
+  {
+    switch (obstacle_class) {
+      case 1: return SCHEDULER_NEAR_DEADLINE_MS;
+      case 2: return SCHEDULER_MID_DEADLINE_MS;
+      default: return SCHEDULER_CLEAR_DEADLINE_MS;
+    }
+  }
+
+  // how many columns of the obstacle grid, from the middle out, the next frame should
+  // be classified over. Narrowing takes the cost down to about 3/5, so it's only
+  // widened again once that would still be within budget
+  int get_zone_columns(int all_columns)
+  {
+    if (obstacle_class != 3) {
+      narrowed = false;
+    } else if (!narrowed) {
+      narrowed = get_budget_interval_ms() > SCHEDULER_CLEAR_INTERVAL_MS;
+    } else {
+      narrowed = get_budget_interval_ms() * all_columns / SCHEDULER_NARROW_COLUMNS > SCHEDULER_CLEAR_INTERVAL_MS;
+    }
+    return narrowed ? std::min(all_columns, SCHEDULER_NARROW_COLUMNS) : all_columns;
+  }
+
+  // whether to process a frame we took at taken, which had been waiting age_ms for
+  // us. A forced frame is always processed
+  bool should_process(std::chrono::steady_clock::time_point taken, float age_ms, bool force)
+  {
+    if (!force) {
+      if (get_ms(taken - last_processed) + SCHEDULER_SLACK_MS < get_interval_ms()) {
+        frames_skipped_for_rate++;
+        return false;
+      }
+
+      float cost = get_expected_cost_ms();
+      float deadline = get_deadline_ms();
+      if (age_ms + cost > deadline && cost <= deadline) {
+        frames_skipped_as_late++;
+        return false;
+      }
+    }
+
+    last_processed = taken;
+    return true;
+  }
+};
+
+frame_scheduler scheduler;
@@ -0,0 +1,398 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <algorithm>
+#include <limits.h>
+#include <string.h>
+
+// Splits the depth frame into the regions enclosed by edges and replaces each one
+// with its mean depth.
+//
+// This labels the same 8-connected components as cv::connectedComponents, but
+// gathers each component's depth statistics while it labels. The frame is cut into
+// tiles which are labelled in parallel: a raster scan gives every pixel of a tile a
+// provisional label, and a union-find records which of those labels turn out to
+// touch. The components which cross from one tile to the next are then joined by a
+// second union-find over the tiles' borders, and a last parallel pass writes out the
+// final labels and paints each component's mean.
+//
+// The tables are kept between frames and grow as needed, so a busy scene can't
+// run out of labels, and a quiet one doesn't allocate.
+//
+// While we're watching for obstacles the camera mostly sees the same scene from one
+// frame to the next, so the segmenter can also work incrementally. A tile's labels
+// only depend on its part of the mask, so a tile whose mask hasn't changed since the
+// last frame keeps its labels, and only has its statistics gathered again from the
+// new depths. The result is exactly the same as labelling everything.
+
+#define SEGMENT_TILE_SIZE 32
+
+// what we know about one component, with its bounding box inclusive
+struct component_stats
+{
+  uint64_t depth_sum;
+  uint32_t count;
+  uint16_t min_depth;
+  int x_min, y_min, x_max, y_max;
+
+  void clear()
+  {
+    depth_sum = 0;
+    count = 0;
+    min_depth = UINT16_MAX;
+    x_min = y_min = INT_MAX;
+    x_max = y_max = INT_MIN;
+  }
+
+  void add(int x, int y, uint16_t depth)
+  {
+    depth_sum += depth;
+    count++;
+    min_depth = std::min(min_depth, depth);
+    x_min = std::min(x_min, x);
+    x_max = std::max(x_max, x);
+    y_min = std::min(y_min, y);
+    y_max = std::max(y_max, y);
+  }
+
+  void merge(const component_stats &other)
+  {
+    depth_sum += other.depth_sum;
+    count += other.count;
+    min_depth = std::min(min_depth, other.min_depth);
+    x_min = std::min(x_min, other.x_min);
+    y_min = std::min(y_min, other.y_min);
+    x_max = std::max(x_max, other.x_max);
+    y_max = std::max(y_max, other.y_max);
+  }
+
+  uint16_t mean_depth() const
+  {
+    return count > 0 ? depth_sum / count : 0;
+  }
+};
+
+// a union-find over labels. The lower label always becomes the parent, so parents
+// come before their children
+struct label_forest
+{
+  std::vector<uint32_t> parents;
+
+  void clear()
+  {
+    parents.clear();
+  }
+
+  uint32_t add()
+  {
+    uint32_t label = parents.size();
+    parents.push_back(label);
+    return label;
+  }
+
+  uint32_t find(uint32_t label)
+  {
+    while (parents[label] != label) {
+      parents[label] = parents[parents[label]];
+      label = parents[label];
+    }
+    return label;
+  }
+
+  void unite(uint32_t a, uint32_t b)
+  {
+    a = find(a);
+    b = find(b);
+    if (a < b) parents[b] = a;
+    else parents[a] = b;
+  }
+
+  // replaces every label's parent with its final label, numbering the roots from
+  // 0 in order, and returns how many there are. By the time we get to a label its
+  // parent's entry already holds the final label
+  uint32_t flatten()
+  {
+    uint32_t roots = 0;
+    for (uint32_t label = 0; label < parents.size(); label++) {
+      if (parents[label] == label) {
+        parents[label] = roots++;
+      } else {
+        parents[label] = parents[parents[label]];
+      }
+    }
+    return roots;
+  }
+};
+
+struct segment_tile
+{
+  cv::Rect bounds;
+  label_forest forest;
+  std::vector<component_stats> provisional;
+  // indexed by the tile's own labels, where 0 is the edges and is left empty
+  std::vector<component_stats> components;
+  // the frame-wide label of this tile's label 1
+  uint32_t first_label;
+  // whether the last frame reused the labels from the one before
+  bool reused;
+
+  uint32_t new_label()
+  {
+    provisional.push_back(component_stats());
+    provisional.back().clear();
+    return forest.add();
+  }
+
+  // labels the tile as if nothing outside it existed, leaving its own labels in labels
+  void label(const cv::Mat &mask, const cv::Mat &depth, cv::Mat &labels)
+  {
+    forest.clear();
+    provisional.clear();
+    // label 0 is the edges
+    new_label();
+
+    int x_end = bounds.x + bounds.width;
+    int y_end = bounds.y + bounds.height;
+
+    for (int row = bounds.y; row < y_end; row++) {
+      const uint8_t *in = mask.ptr<uint8_t>(row);
+      const uint16_t *distances = depth.ptr<uint16_t>(row);
+      int32_t *out = labels.ptr<int32_t>(row);
+      const int32_t *above = row > bounds.y ? labels.ptr<int32_t>(row - 1) : NULL;
+
+      for (int col = bounds.x; col < x_end; col++) {
+        if (in[col] == 0) {
+          out[col] = 0;
+          continue;
+        }
+
+        uint32_t n = above ? above[col] : 0;
+        uint32_t nw = (above && col > bounds.x) ? above[col - 1] : 0;
+        uint32_t ne = (above && col + 1 < x_end) ? above[col + 1] : 0;
+        uint32_t w = col > bounds.x ? out[col - 1] : 0;
+
+        // the pixel above touches all the others, so they're already joined to it.
+        // Otherwise the pixel above right is the only one which might not be
+        uint32_t label;
+        if (n) {
+          label = n;
+        } else if (ne) {
+          label = ne;
+          if (nw) forest.unite(ne, nw);
+          else if (w) forest.unite(ne, w);
+        } else if (nw) {
+          label = nw;
+        } else if (w) {
+          label = w;
+        } else {
+          label = new_label();
+        }
+
+        out[col] = label;
+        provisional[label].add(col, row, distances[col]);
+      }
+    }
+
+    // fold the provisional labels into the tile's components
+    uint32_t component_count = forest.flatten();
+    components.resize(component_count);
+    for (uint32_t i = 0; i < component_count; i++) {
+      components[i].clear();
+    }
+    for (uint32_t label = 1; label < provisional.size(); label++) {
+      components[forest.parents[label]].merge(provisional[label]);
+    }
+
+    for (int row = bounds.y; row < y_end; row++) {
+      int32_t *out = labels.ptr<int32_t>(row);
+      for (int col = bounds.x; col < x_end; col++) {
+        out[col] = forest.parents[out[col]];
+      }
+    }
+  }
+
+  // copies the tile's part of mask over previous, returning whether any of it changed
+  bool update_mask(const cv::Mat &mask, cv::Mat &previous)
+  {
+    bool changed = false;
+    for (int row = bounds.y; row < bounds.y + bounds.height; row++) {
+      const uint8_t *in = mask.ptr<uint8_t>(row) + bounds.x;
+      uint8_t *out = previous.ptr<uint8_t>(row) + bounds.x;
+      if (memcmp(in, out, bounds.width) != 0) {
+        memcpy(out, in, bounds.width);
+        changed = true;
+      }
+    }
+    return changed;
+  }
+
+  // gathers the components' statistics again from new depths, using the labels
+  // from the last time the tile was labelled
+  void gather(const cv::Mat &depth, const cv::Mat &labels)
+  {
+    for (size_t i = 0; i < components.size(); i++) {
+      components[i].clear();
+    }
+
+    for (int row = bounds.y; row < bounds.y + bounds.height; row++) {
+      const uint16_t *distances = depth.ptr<uint16_t>(row);
+      const int32_t *in = labels.ptr<int32_t>(row);
+      for (int col = bounds.x; col < bounds.x + bounds.width; col++) {
+        if (in[col] != 0) components[in[col]].add(col, row, distances[col]);
+      }
+    }
+  }
+
+  uint32_t frame_label(int32_t label) const
+  {
+    return label == 0 ? 0 : first_label + label - 1;
+  }
+};
+
+class depth_segmenter
+{
+  std::vector<segment_tile> tiles;
+  int tile_columns;
+  // joins the components of neighbouring tiles, over frame-wide labels
+  label_forest forest;
+
+  // each tile's own labels, and the mask they came from
+  cv::Mat tile_labels;
+  cv::Mat previous_mask;
+
+  segment_tile &get_tile(int row, int col)
+  {
+    return tiles[(row / SEGMENT_TILE_SIZE) * tile_columns + col / SEGMENT_TILE_SIZE];
+  }
+
+  void join(int row_a, int col_a, int row_b, int col_b)
+  {
+    int32_t a = tile_labels.at<int32_t>(row_a, col_a);
+    int32_t b = tile_labels.at<int32_t>(row_b, col_b);
+    if (a == 0 || b == 0) return;
+
+    forest.unite(get_tile(row_a, col_a).frame_label(a), get_tile(row_b, col_b).frame_label(b));
+  }
+
+  void create_tiles(cv::Size size)
+  {
+    tile_columns = (size.width + SEGMENT_TILE_SIZE - 1) / SEGMENT_TILE_SIZE;
+    int tile_rows = (size.height + SEGMENT_TILE_SIZE - 1) / SEGMENT_TILE_SIZE;
+    tiles.resize(tile_columns * tile_rows);
+
+    for (int i = 0; i < (int)tiles.size(); i++) {
+      int x = (i % tile_columns) * SEGMENT_TILE_SIZE;
+      int y = (i / tile_columns) * SEGMENT_TILE_SIZE;
+      tiles[i].bounds = cv::Rect(x, y, SEGMENT_TILE_SIZE, SEGMENT_TILE_SIZE)
+        & cv::Rect(0, 0, size.width, size.height);
+    }
+  }
+
+public:
+  // CV_32S, 0 for the edges and 1 upwards for the components
+  cv::Mat labels;
+  // indexed by label, where 0 is the edges and is left empty
+  std::vector<component_stats> components;
+  // how many tiles kept their labels from the frame before
+  int reused_tiles;
+
+  // labels the non-zero pixels of mask, then replaces the depth of each of those
+  // pixels with the mean of its component. Returns the number of components.
+  //
+  // If incremental is set and the mask is the same size as last time, only the
+  // tiles whose mask has changed are labelled again
+  int segment(const cv::Mat &mask, cv::Mat depth, bool incremental = false)
+  {
+    assert(mask.type() == CV_8UC1);
+    assert(depth.type() == CV_16UC1);
+    assert(mask.rows == depth.rows && mask.cols == depth.cols);
+
+    bool same_size = previous_mask.rows == mask.rows && previous_mask.cols == mask.cols;
+    incremental = incremental && same_size;
+
+    labels.create(mask.rows, mask.cols, CV_32S);
+    tile_labels.create(mask.rows, mask.cols, CV_32S);
+    previous_mask.create(mask.rows, mask.cols, CV_8UC1);
+    create_tiles(cv::Size(mask.cols, mask.rows));
+
+    cv::parallel_for_(cv::Range(0, tiles.size()), [&](const cv::Range &range) {
+      for (int i = range.start; i < range.end; i++) {
+        segment_tile &tile = tiles[i];
+        bool changed = tile.update_mask(mask, previous_mask);
+
+        tile.reused = incremental && !changed;
+        if (tile.reused) {
+          tile.gather(depth, tile_labels);
+        } else {
+          tile.label(mask, depth, tile_labels);
+        }
+      }
+    });
+
+    reused_tiles = 0;
+    for (size_t i = 0; i < tiles.size(); i++) {
+      if (tiles[i].reused) reused_tiles++;
+    }
+
+    // give every tile's components their own frame-wide labels
+    forest.clear();
+    forest.add();
+    for (size_t i = 0; i < tiles.size(); i++) {
+      tiles[i].first_label = forest.parents.size();
+      for (size_t label = 1; label < tiles[i].components.size(); label++) {
+        forest.add();
+      }
+    }
+
+    // join the components which touch across the tile borders, including at the corners
+    for (int row = SEGMENT_TILE_SIZE - 1; row + 1 < mask.rows; row += SEGMENT_TILE_SIZE) {
+      for (int col = 0; col < mask.cols; col++) {
+        for (int other = std::max(col - 1, 0); other <= std::min(col + 1, mask.cols - 1); other++) {
+          join(row, col, row + 1, other);
+        }
+      }
+    }
+    for (int col = SEGMENT_TILE_SIZE - 1; col + 1 < mask.cols; col += SEGMENT_TILE_SIZE) {
+      for (int row = 0; row < mask.rows; row++) {
+        for (int other = std::max(row - 1, 0); other <= std::min(row + 1, mask.rows - 1); other++) {
+          join(row, col, other, col + 1);
+        }
+      }
+    }
+
+    uint32_t component_count = forest.flatten();
+    components.resize(component_count);
+    for (uint32_t i = 0; i < component_count; i++) {
+      components[i].clear();
+    }
+    for (size_t i = 0; i < tiles.size(); i++) {
+      for (size_t label = 1; label < tiles[i].components.size(); label++) {
+        components[forest.parents[tiles[i].frame_label(label)]].merge(tiles[i].components[label]);
+      }
+    }
+
+    // write out the final labels and paint the means
+    cv::parallel_for_(cv::Range(0, tiles.size()), [&](const cv::Range &range) {
+      for (int i = range.start; i < range.end; i++) {
+        const segment_tile &tile = tiles[i];
+        for (int row = tile.bounds.y; row < tile.bounds.y + tile.bounds.height; row++) {
+          uint16_t *distances = depth.ptr<uint16_t>(row);
+          const int32_t *in = tile_labels.ptr<int32_t>(row);
+          int32_t *out = labels.ptr<int32_t>(row);
+
+          for (int col = tile.bounds.x; col < tile.bounds.x + tile.bounds.width; col++) {
+            if (in[col] == 0) {
+              out[col] = 0;
+              continue;
+            }
+            out[col] = forest.parents[tile.frame_label(in[col])];
+            distances[col] = components[out[col]].mean_depth();
+          }
+        }
+      }
+    });
+
+    return component_count - 1;
+  }
+};
@@ -0,0 +1,126 @@
+#pragma once
+
+// Thin wrappers over the vector instructions we build for: NEON on the Pi and SSE2
+// on x86. Kernels are written against these so that one loop covers both, and each
+// kernel keeps a scalar loop for the tail of a row (and for other platforms).
+//
+// Nearly everything here works on 8 lanes of uint16_t, which is what our Z16 depth
+// is. The few f32x4 helpers are for the geometry, which takes 8 depths as two halves.
+
+#include <stdint.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define THESIS_SIMD_NEON 1
+#define THESIS_SIMD 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define THESIS_SIMD_SSE2 1
+#define THESIS_SIMD 1
+#else
+#define THESIS_SIMD 0
+#endif
+
+#define U16X8_LANES 8
+#define F32X4_LANES 4
+
+#if THESIS_SIMD_NEON
+
+typedef uint16x8_t u16x8;
+
+inline u16x8 u16x8_load(const uint16_t *p) { return vld1q_u16(p); }
+inline void u16x8_store(uint16_t *p, u16x8 v) { vst1q_u16(p, v); }
+inline u16x8 u16x8_set1(uint16_t x) { return vdupq_n_u16(x); }
+inline u16x8 u16x8_zero() { return vdupq_n_u16(0); }
+// widens 8 bytes to 8 lanes
+inline u16x8 u16x8_load_u8(const uint8_t *p) { return vmovl_u8(vld1_u8(p)); }
+// narrows 8 lanes which each fit in a byte
+inline void u16x8_store_u8(uint8_t *p, u16x8 v) { vst1_u8(p, vmovn_u16(v)); }
+
+inline u16x8 u16x8_add(u16x8 a, u16x8 b) { return vaddq_u16(a, b); }
+inline u16x8 u16x8_sub(u16x8 a, u16x8 b) { return vsubq_u16(a, b); }
+inline u16x8 u16x8_and(u16x8 a, u16x8 b) { return vandq_u16(a, b); }
+inline u16x8 u16x8_or(u16x8 a, u16x8 b) { return vorrq_u16(a, b); }
+inline u16x8 u16x8_xor(u16x8 a, u16x8 b) { return veorq_u16(a, b); }
+inline u16x8 u16x8_min(u16x8 a, u16x8 b) { return vminq_u16(a, b); }
+inline u16x8 u16x8_max(u16x8 a, u16x8 b) { return vmaxq_u16(a, b); }
+template<int N> inline u16x8 u16x8_shr(u16x8 v) { return vshrq_n_u16(v, N); }
+
+// all ones in lanes which are zero
+inline u16x8 u16x8_eq_zero(u16x8 v) { return vceqq_u16(v, vdupq_n_u16(0)); }
+// all ones in lanes where a >= b
+inline u16x8 u16x8_ge(u16x8 a, u16x8 b) { return vcgeq_u16(a, b); }
+// picks a where mask is set, otherwise b
+inline u16x8 u16x8_select(u16x8 mask, u16x8 a, u16x8 b) { return vbslq_u16(mask, a, b); }
+
+// moves every lane N places towards the end of the row, shifting in zeros
+template<int N> inline u16x8 u16x8_shift_up(u16x8 v) { return vextq_u16(vdupq_n_u16(0), v, 8 - N); }
+// copies the last lane to every lane
+inline u16x8 u16x8_broadcast_last(u16x8 v) { return vdupq_n_u16(vgetq_lane_u16(v, 7)); }
+
+typedef float32x4_t f32x4;
+
+inline f32x4 f32x4_load(const float *p) { return vld1q_f32(p); }
+inline f32x4 f32x4_set1(float x) { return vdupq_n_f32(x); }
+inline f32x4 f32x4_add(f32x4 a, f32x4 b) { return vaddq_f32(a, b); }
+inline f32x4 f32x4_mul(f32x4 a, f32x4 b) { return vmulq_f32(a, b); }
+inline f32x4 f32x4_abs(f32x4 v) { return vabsq_f32(v); }
+// converts the first or last 4 lanes
+inline f32x4 u16x8_low_f32(u16x8 v) { return vcvtq_f32_u32(vmovl_u16(vget_low_u16(v))); }
+inline f32x4 u16x8_high_f32(u16x8 v) { return vcvtq_f32_u32(vmovl_u16(vget_high_u16(v))); }
+// all ones in the lanes where low (the first 4) and high (the last 4) are less than limit
+inline u16x8 f32x4_lt_u16x8(f32x4 low, f32x4 high, f32x4 limit)
+{
+  return vcombine_u16(vmovn_u32(vcltq_f32(low, limit)), vmovn_u32(vcltq_f32(high, limit)));
+}
+
+#elif THESIS_SIMD_SSE2
+
+typedef __m128i u16x8;
+
+inline u16x8 u16x8_load(const uint16_t *p) { return _mm_loadu_si128((const __m128i *)p); }
+inline void u16x8_store(uint16_t *p, u16x8 v) { _mm_storeu_si128((__m128i *)p, v); }
+inline u16x8 u16x8_set1(uint16_t x) { return _mm_set1_epi16(x); }
+inline u16x8 u16x8_zero() { return _mm_setzero_si128(); }
+inline u16x8 u16x8_load_u8(const uint8_t *p) { return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)p), _mm_setzero_si128()); }
+inline void u16x8_store_u8(uint8_t *p, u16x8 v) { _mm_storel_epi64((__m128i *)p, _mm_packus_epi16(v, v)); }
+
+inline u16x8 u16x8_add(u16x8 a, u16x8 b) { return _mm_add_epi16(a, b); }
+inline u16x8 u16x8_sub(u16x8 a, u16x8 b) { return _mm_sub_epi16(a, b); }
+inline u16x8 u16x8_and(u16x8 a, u16x8 b) { return _mm_and_si128(a, b); }
+inline u16x8 u16x8_or(u16x8 a, u16x8 b) { return _mm_or_si128(a, b); }
+inline u16x8 u16x8_xor(u16x8 a, u16x8 b) { return _mm_xor_si128(a, b); }
+// SSE2 has no unsigned 16 bit min/max, but saturating subtraction gets us there
+inline u16x8 u16x8_min(u16x8 a, u16x8 b) { return _mm_sub_epi16(a, _mm_subs_epu16(a, b)); }
+inline u16x8 u16x8_max(u16x8 a, u16x8 b) { return _mm_add_epi16(b, _mm_subs_epu16(a, b)); }
+template<int N> inline u16x8 u16x8_shr(u16x8 v) { return _mm_srli_epi16(v, N); }
+
+inline u16x8 u16x8_eq_zero(u16x8 v) { return _mm_cmpeq_epi16(v, _mm_setzero_si128()); }
+// b - a only saturates to zero when a >= b
+inline u16x8 u16x8_ge(u16x8 a, u16x8 b) { return _mm_cmpeq_epi16(_mm_subs_epu16(b, a), _mm_setzero_si128()); }
+inline u16x8 u16x8_select(u16x8 mask, u16x8 a, u16x8 b) { return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b)); }
+
+template<int N> inline u16x8 u16x8_shift_up(u16x8 v) { return _mm_slli_si128(v, 2 * N); }
+inline u16x8 u16x8_broadcast_last(u16x8 v)
+{
+  u16x8 high = _mm_shufflehi_epi16(v, 0xFF);
+  return _mm_unpackhi_epi64(high, high);
+}
+
+typedef __m128 f32x4;
+
+inline f32x4 f32x4_load(const float *p) { return _mm_loadu_ps(p); }
+inline f32x4 f32x4_set1(float x) { return _mm_set1_ps(x); }
+inline f32x4 f32x4_add(f32x4 a, f32x4 b) { return _mm_add_ps(a, b); }
+inline f32x4 f32x4_mul(f32x4 a, f32x4 b) { return _mm_mul_ps(a, b); }
+// clears the sign bits
+inline f32x4 f32x4_abs(f32x4 v) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), v); }
+inline f32x4 u16x8_low_f32(u16x8 v) { return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, _mm_setzero_si128())); }
+inline f32x4 u16x8_high_f32(u16x8 v) { return _mm_cvtepi32_ps(_mm_unpackhi_epi16(v, _mm_setzero_si128())); }
+// the comparisons give -1 or 0 in each 32 bit lane, which the signed pack keeps as is
+inline u16x8 f32x4_lt_u16x8(f32x4 low, f32x4 high, f32x4 limit)
+{
+  return _mm_packs_epi32(_mm_castps_si128(_mm_cmplt_ps(low, limit)), _mm_castps_si128(_mm_cmplt_ps(high, limit)));
+}
+
+#endif
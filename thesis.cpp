@@ -6,11 +6,28 @@
 #include <math.h>               // used for trig functions
 #include <ctime>                // for performance timing
 #include <librealsense2/rsutil.h>
+#include <poll.h>
+#include <signal.h>
 
 #include "cv-helpers.cpp"
 #include "visualisation.cpp"
+#include "frame-source.cpp"
+#include "depth-codec.cpp"
+#include "depth-recording.cpp"
+#include "depth-filters.cpp"
+#include "frame-gating.cpp"
+#include "realtime.cpp"
+#include "scheduler.cpp"
+#include "segmentation.cpp"
+#include "occupancy.cpp"
 #include "audio.cpp"
+#include "control.cpp"
+#include "rays.cpp"
+#include "ground.cpp"
+#include "polar.cpp"
+#include "pipeline.cpp"
 #include "sampling.cpp"
+#include "benchmark.cpp"
 
 // input codes for our Logitech clicker
 #define CLICKER_LEFT 339
@@ -23,11 +40,46 @@ void setup_input()
 
   keypad(stdscr, TRUE);
   mousemask(ALL_MOUSE_EVENTS, NULL);
+  // the input loop sleeps in poll() until there's a key or output from another
+  // thread, so getch only has to read what's already there
+  timeout(0);
+  screen.open();
+}
+
+// SIGINT and SIGTERM only interrupt the input loop, which is the one place
+// they're let through, and it then leaves so the program can shut down properly
+volatile sig_atomic_t quit_signalled = 0;
+sigset_t quit_signals;
+
+void on_quit_signal(int)
+{
+  quit_signalled = 1;
+}
+
+// call this before any other thread is started, so they all leave the quit signals
+// to the input loop
+void setup_quit_signals()
+{
+  sigemptyset(&quit_signals);
+  sigaddset(&quit_signals, SIGINT);
+  sigaddset(&quit_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &quit_signals, NULL);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = on_quit_signal;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
 }
 
 void cleanup()
 {
+  // the sampling thread is stopped first, as it's what plays sounds and takes frames
+  stop_sampling_thread();
   endwin();
+  stop_recording(source);
+  stop_audio();
   if (pcm_handle != NULL)
   {
     snd_pcm_drain(pcm_handle);
@@ -37,46 +89,161 @@ void cleanup()
 
 
 void play_startup_sound(){
-  audio_pointers_count = 1;
-  audio_pointers[0].delayms = 0;
-  audio_pointers[0].left_amount = 0.7;
-  audio_pointers[0].right_amount = 0.7;
-  audio_pointers[0].sound_index = 1;
-  sound_ready = true;
+  audio_pointer startup;
+  startup.delayms = 0;
+  startup.left_amount = 0.7;
+  startup.right_amount = 0.7;
+  startup.sound_index = 1;
+  play_scene(&startup, 1);
 }
 
+// reads the keyboard, and prints what the other threads have posted to the screen,
+// until the program is asked to quit
 void loop()
 {
-  while (1)
+  // the quit signals are only let through while we're waiting, so one can't arrive
+  // between checking quit_signalled and going to sleep
+  sigset_t waiting_signals;
+  pthread_sigmask(SIG_BLOCK, NULL, &waiting_signals);
+  sigdelset(&waiting_signals, SIGINT);
+  sigdelset(&waiting_signals, SIGTERM);
+
+  while (!quit_signalled)
   {
-    int ch = getch();
-    if (ch != -1)
+    struct pollfd fds[2] = { { STDIN_FILENO, POLLIN, 0 }, { screen.get_wake_fd(), POLLIN, 0 } };
+    ppoll(fds, 2, NULL, &waiting_signals);
+    screen.print_pending();
+
+    int ch;
+    while ((ch = getch()) != ERR)
     {
       switch (ch)
       {
       case CLICKER_LEFT:
-        low_power_mode = false;
-        ready_for_sample = true;
+        control.click();
         break;
       case CLICKER_RIGHT:
-        low_power_mode = false;
-        ready_for_sample = true;
+        control.click();
         break;
       // for some reason, this requires 2 clicks of the button.
       // I'm calling this a feature not a bug
       case CLICKER_POWER:
-        low_power_mode = true;
+        control.request_low_power();
         break;
       }
     }
   }
 }
 
+// the ALSA device can be given as a plain argument. Frames can be replayed from a
+// recording with --replay <file> [--replay-rate recorded|fast|<fps>], and every
+// frame can be recorded with --record <file> [--record-codec raw|delta]. With
+// --full-frame every stage processes the whole frame rather than just the pixels read.
+// --benchmark checks and times the filters over a --replay instead of running.
+// --edges meters|laplacian|sobel picks how edges are found (see depth-filters.cpp).
+// --keep-floor counts the floor towards obstacles like everything else (see ground.cpp).
+// --polar-bins <n>, --polar-band <degrees> and --polar-percentile <0-100> set up the
+// histogram the clap pointers read from (see polar.cpp). --process-every-frame
+// processes frames which look the same as the last one too (see frame-gating.cpp),
+// and every frame however much time it costs (see scheduler.cpp), while
+// --cpu-budget <percent> sets how much of a core the scheduler lets it use.
+// --no-pipeline runs the stages of processing a frame one after another on one
+// thread, rather than on a thread each (see pipeline.cpp). --audio-priority <0-99>,
+// --thread-cores <audio>,<sampling>,<capture>,<segment>|off and --no-mlock set up
+// how the threads are scheduled (see realtime.cpp)
+const char *audio_device = PCM_DEFAULT_DEVICE;
+
+void parse_arguments(int argc, char *argv[])
+{
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+      replay_path = argv[++i];
+    } else if (strcmp(argv[i], "--replay-rate") == 0 && i + 1 < argc) {
+      parse_replay_rate(argv[++i]);
+    } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+      record_path = argv[++i];
+    } else if (strcmp(argv[i], "--record-codec") == 0 && i + 1 < argc) {
+      parse_record_codec(argv[++i]);
+    } else if (strcmp(argv[i], "--full-frame") == 0) {
+      use_regions_of_interest = false;
+    } else if (strcmp(argv[i], "--edges") == 0 && i + 1 < argc) {
+      parse_edge_mode(argv[++i]);
+    } else if (strcmp(argv[i], "--polar-bins") == 0 && i + 1 < argc) {
+      parse_polar_bins(argv[++i]);
+    } else if (strcmp(argv[i], "--polar-band") == 0 && i + 1 < argc) {
+      parse_polar_band(argv[++i]);
+    } else if (strcmp(argv[i], "--polar-percentile") == 0 && i + 1 < argc) {
+      parse_polar_percentile(argv[++i]);
+    } else if (strcmp(argv[i], "--process-every-frame") == 0) {
+      use_frame_gating = false;
+      use_frame_scheduler = false;
+    } else if (strcmp(argv[i], "--cpu-budget") == 0 && i + 1 < argc) {
+      parse_cpu_budget(argv[++i]);
+    } else if (strcmp(argv[i], "--audio-priority") == 0 && i + 1 < argc) {
+      parse_audio_priority(argv[++i]);
+    } else if (strcmp(argv[i], "--thread-cores") == 0 && i + 1 < argc) {
+      parse_thread_cores(argv[++i]);
+    } else if (strcmp(argv[i], "--no-mlock") == 0) {
+      use_memory_locking = false;
+    } else if (strcmp(argv[i], "--no-pipeline") == 0) {
+      use_pipeline = false;
+    } else if (strcmp(argv[i], "--keep-floor") == 0) {
+      use_floor_removal = false;
+    } else if (strcmp(argv[i], "--benchmark") == 0) {
+      benchmark_mode = true;
+    } else {
+      audio_device = argv[i];
+    }
+  }
+}
+
+// picks the replay or the camera depending on the command line. Viewer .raw dumps
+// are recognised by their extension, anything else is taken to be one of our recordings
+frame_source *create_frame_source()
+{
+  if (replay_path == NULL) {
+    return new realsense_frame_source();
+  }
+
+  std::string path(replay_path);
+  if (path.size() > 4 && path.compare(path.size() - 4, 4, ".raw") == 0) {
+    return new raw_replay_frame_source(replay_path);
+  }
+  return new recording_replay_frame_source(replay_path);
+}
+
+// goes through the whole replay as fast as possible, once
+int benchmark()
+{
+  if (replay_path == NULL) {
+    fprintf(stderr, "--benchmark needs a recording to --replay\n");
+    return EXIT_FAILURE;
+  }
+
+  replay_rate = REPLAY_RATE_FAST;
+  replay_loop = false;
+
+  try {
+    return benchmark_filters(create_frame_source());
+  } catch (const std::exception &e) {
+    fprintf(stderr, "Benchmark failed: %s\n", e.what());
+    return EXIT_FAILURE;
+  }
+}
+
 int main(int argc, char *argv[]) try
 {
-  
+  parse_arguments(argc, argv);
+
+  if (benchmark_mode) {
+    return benchmark();
+  }
+
   setup_input();
+  setup_quit_signals();
   printw("Input configured \n");
+  // before any other thread is started, so OpenCV's workers aren't created pinned
+  thread_setup.start_worker_pool();
   printw("Reading audio file from clap.wav\n");
   read_audio_file("clap.wav", SOUND_INDEX_CLAP);
   printw("Reading audio file from ready.wav\n");
@@ -88,41 +255,30 @@ int main(int argc, char *argv[]) try
   printw("Configuring audio...\n");
   refresh();
 
-  if (argc <= 1)
-  {
-    setup_audio(PCM_DEFAULT_DEVICE);
-  }
-  else
-  {
-    setup_audio(argv[1]);
-  }
+  setup_audio(audio_device);
   refresh();
 
   printw("Starting depth camera...\n");
   refresh();
 
-  using namespace cv;
-  // Create a Pipeline - this serves as a top-level API for streaming and processing frames
-  p = new rs2::pipeline();
-  // Configure and start the pipeline
-  rs2::pipeline_profile selection = p->start();
-
-  printw("%i profiles found\n",selection.get_streams().size());
-  refresh();
+  // Create the camera (or the replay) - this serves as the source of our depth frames
+  source = create_frame_source();
+  source->start();
 
-  for (auto s : selection.get_streams()) {
-    printw(s.stream_name().c_str()); printw("\n"); refresh();
+  if (record_path != NULL) {
+    printw("Recording depth frames to %s\n", record_path);
+    start_recording(source, record_path);
   }
 
-  auto depth_stream = selection.get_stream(RS2_STREAM_DEPTH)
-                          .as<rs2::video_stream_profile>();
-
-  auto intrins = depth_stream.get_intrinsics();
+  auto intrins = source->get_intrinsics();
   float fov[2]; // X, Y fov
   rs2_fov(&intrins, fov);
   fovwidth = fov[0];
   fovheight = fov[1];
-  printw("Depth camera initialised with FOV %f (horiz) %f (vert)", fov[0], fov[1]);
+  printw("Depth camera initialised with FOV %f (horiz) %f (vert)\n", fov[0], fov[1]);
+
+  rays.build(intrins, get_decimation_amount(intrins.width), source->get_serial());
+  printw("Ray tables built for %dx%d\n", rays.width, rays.height);
 
   play_startup_sound();
 
@@ -130,10 +286,13 @@ int main(int argc, char *argv[]) try
 
   start_sampling_thread();
 
+  // by now everything the threads need at startup has been loaded
+  thread_setup.lock_memory();
+  thread_setup.print_report();
+  refresh();
+
   loop();
 
-  refresh();
-  sleep(5);
   cleanup();
   return EXIT_SUCCESS;
 }
@@ -41,7 +41,11 @@ void export_to_csv(cv::Mat matrix, const char* filepath)
   myfile.close();
 } */
 
-void visualise_distance(cv::Mat matrix, int window_number)
+// the matrices are scaled by 40 for display, which suits depth in meters
+#define VISUALISE_M_SCALE 40
+#define VISUALISE_MM_SCALE 0.04
+
+void visualise_distance(cv::Mat matrix, int window_number, double scale = VISUALISE_M_SCALE)
 {
   if (!use_visualisation) return;
 
@@ -62,7 +66,7 @@ void visualise_distance(cv::Mat matrix, int window_number)
       break;
   }
 
-  cv::Mat scaled = matrix.clone()*40;
+  cv::Mat scaled = matrix.clone()*scale;
   scaled.convertTo(scaled, CV_8UC1);
   cv::applyColorMap(scaled, scaled, 2);
 